@@ -136,7 +136,7 @@ main (int argc, char *argv[]) {
     if (tcp_api_bind(soc, hton16(ECHO_SERVER_PORT)) == -1) {
         goto ERROR;
     }
-    tcp_api_listen(soc);
+    tcp_api_listen(soc, 0);
     fprintf(stderr, "waiting for connection...\n");
     acc = tcp_api_accept(soc);
     if (acc == -1) {
@@ -41,8 +41,7 @@ struct arp_entry {
     uint8_t ha[ETHERNET_ADDR_LEN];
     time_t timestamp;
     pthread_cond_t cond;
-    void *data;
-    size_t len;
+    struct pkbuf *pkb;
     struct netif *netif;
 };
 
@@ -100,15 +99,14 @@ arp_table_update (struct netdev *dev, const ip_addr_t *pa, const uint8_t *ha) {
     }
     memcpy(entry->ha, ha, ETHERNET_ADDR_LEN);
     time(&entry->timestamp);
-    if (entry->data) {
+    if (entry->pkb) {
         if (entry->netif->dev != dev) {
             /* warning: receive response from unintended device */
             dev = entry->netif->dev;
         }
-        dev->ops->tx(dev, ETHERNET_TYPE_IP, (uint8_t *)entry->data, entry->len, entry->ha);
-        free(entry->data);
-        entry->data = NULL;
-        entry->len = 0;
+        dev->ops->tx(dev, ETHERNET_TYPE_IP, entry->pkb, entry->ha);
+        pkbuf_free(entry->pkb);
+        entry->pkb = NULL;
     }
     pthread_cond_broadcast(&entry->cond);
     return 0;
@@ -148,10 +146,9 @@ arp_entry_clear (struct arp_entry *entry) {
     entry->pa = 0;
     memset(entry->ha, 0, ETHERNET_ADDR_LEN);
     entry->timestamp = 0;
-    if (entry->data) {
-        free(entry->data);
-        entry->data = NULL;
-        entry->len = 0;
+    if (entry->pkb) {
+        pkbuf_free(entry->pkb);
+        entry->pkb = NULL;
     }
     entry->netif = NULL;
     /* !!! Don't touch entry->cond !!! */
@@ -171,25 +168,34 @@ arp_table_patrol (void) {
 
 static int
 arp_send_request (struct netif *netif, const ip_addr_t *tpa) {
-    struct arp_ethernet request;
+    struct pkbuf *pkb;
+    struct arp_ethernet *request;
+    ssize_t ret;
 
     if (!tpa) {
         return -1;
     }
-    request.hdr.hrd = hton16(ARP_HRD_ETHERNET);
-    request.hdr.pro = hton16(ETHERNET_TYPE_IP);
-    request.hdr.hln = ETHERNET_ADDR_LEN;
-    request.hdr.pln = IP_ADDR_LEN;
-    request.hdr.op = hton16(ARP_OP_REQUEST);
-    memcpy(request.sha, netif->dev->addr, ETHERNET_ADDR_LEN);
-    request.spa = ((struct netif_ip *)netif)->unicast;
-    memset(request.tha, 0, ETHERNET_ADDR_LEN);
-    request.tpa = *tpa;
+    pkb = pkbuf_alloc(sizeof(struct arp_ethernet));
+    if (!pkb) {
+        return -1;
+    }
+    request = (struct arp_ethernet *)pkbuf_put(pkb, sizeof(struct arp_ethernet));
+    request->hdr.hrd = hton16(ARP_HRD_ETHERNET);
+    request->hdr.pro = hton16(ETHERNET_TYPE_IP);
+    request->hdr.hln = ETHERNET_ADDR_LEN;
+    request->hdr.pln = IP_ADDR_LEN;
+    request->hdr.op = hton16(ARP_OP_REQUEST);
+    memcpy(request->sha, netif->dev->addr, ETHERNET_ADDR_LEN);
+    request->spa = ((struct netif_ip *)netif)->unicast;
+    memset(request->tha, 0, ETHERNET_ADDR_LEN);
+    request->tpa = *tpa;
 #ifdef DEBUG
     fprintf(stderr, ">>> arp_send_request <<<\n");
-    arp_dump((uint8_t *)&request, sizeof(request));
+    arp_dump((uint8_t *)request, sizeof(*request));
 #endif
-    if (netif->dev->ops->tx(netif->dev, ETHERNET_TYPE_ARP, (uint8_t *)&request, sizeof(request), ETHERNET_ADDR_BROADCAST) == -1) {
+    ret = netif->dev->ops->tx(netif->dev, ETHERNET_TYPE_ARP, pkb, ETHERNET_ADDR_BROADCAST);
+    pkbuf_free(pkb);
+    if (ret == -1) {
         return -1;
     }
     return 0;
@@ -197,25 +203,34 @@ arp_send_request (struct netif *netif, const ip_addr_t *tpa) {
 
 static int
 arp_send_reply (struct netif *netif, const uint8_t *tha, const ip_addr_t *tpa, const uint8_t *dst) {
-    struct arp_ethernet reply;
+    struct pkbuf *pkb;
+    struct arp_ethernet *reply;
+    ssize_t ret;
 
     if (!tha || !tpa) {
         return -1;
     }
-    reply.hdr.hrd = hton16(ARP_HRD_ETHERNET);
-    reply.hdr.pro = hton16(ETHERNET_TYPE_IP);
-    reply.hdr.hln = ETHERNET_ADDR_LEN;
-    reply.hdr.pln = IP_ADDR_LEN;
-    reply.hdr.op = hton16(ARP_OP_REPLY);
-    memcpy(reply.sha, netif->dev->addr, ETHERNET_ADDR_LEN);
-    reply.spa = ((struct netif_ip *)netif)->unicast;
-    memcpy(reply.tha, tha, ETHERNET_ADDR_LEN);
-    reply.tpa = *tpa;
+    pkb = pkbuf_alloc(sizeof(struct arp_ethernet));
+    if (!pkb) {
+        return -1;
+    }
+    reply = (struct arp_ethernet *)pkbuf_put(pkb, sizeof(struct arp_ethernet));
+    reply->hdr.hrd = hton16(ARP_HRD_ETHERNET);
+    reply->hdr.pro = hton16(ETHERNET_TYPE_IP);
+    reply->hdr.hln = ETHERNET_ADDR_LEN;
+    reply->hdr.pln = IP_ADDR_LEN;
+    reply->hdr.op = hton16(ARP_OP_REPLY);
+    memcpy(reply->sha, netif->dev->addr, ETHERNET_ADDR_LEN);
+    reply->spa = ((struct netif_ip *)netif)->unicast;
+    memcpy(reply->tha, tha, ETHERNET_ADDR_LEN);
+    reply->tpa = *tpa;
 #ifdef DEBUG
     fprintf(stderr, ">>> arp_send_reply <<<\n");
-    arp_dump((uint8_t *)&reply, sizeof(reply));
+    arp_dump((uint8_t *)reply, sizeof(*reply));
 #endif
-    if (netif->dev->ops->tx(netif->dev, ETHERNET_TYPE_ARP, (uint8_t *)&reply, sizeof(reply), dst) < 0) {
+    ret = netif->dev->ops->tx(netif->dev, ETHERNET_TYPE_ARP, pkb, dst);
+    pkbuf_free(pkb);
+    if (ret < 0) {
         return -1;
     }
     return 0;
@@ -271,7 +286,7 @@ arp_rx (uint8_t *packet, size_t plen, struct netdev *dev) {
 }
 
 int
-arp_resolve (struct netif *netif, const ip_addr_t *pa, uint8_t *ha, const void *data, size_t len) {
+arp_resolve (struct netif *netif, const ip_addr_t *pa, uint8_t *ha, struct pkbuf *pkb) {
     struct timeval now;
     struct timespec timeout;
     struct arp_entry *entry;
@@ -305,14 +320,9 @@ arp_resolve (struct netif *netif, const ip_addr_t *pa, uint8_t *ha, const void *
         pthread_mutex_unlock(&mutex);
         return ARP_RESOLVE_ERROR;
     }
-    if (data) {
-        entry->data = malloc(len);
-        if (!entry->data) {
-            pthread_mutex_unlock(&mutex);
-            return ARP_RESOLVE_ERROR;
-        }
-        memcpy(entry->data, data, len);
-        entry->len = len;
+    if (pkb) {
+        /* hold the packet until the reply arrives, no copy needed */
+        entry->pkb = pkbuf_ref(pkb);
     }
     entry->used = 1;
     entry->pa = *pa;
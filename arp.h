@@ -13,6 +13,6 @@
 extern int
 arp_init (void);
 extern int
-arp_resolve (struct netif *netif, const ip_addr_t *pa, uint8_t *ha, const void *data, size_t len);
+arp_resolve (struct netif *netif, const ip_addr_t *pa, uint8_t *ha, struct pkbuf *pkb);
 
 #endif
@@ -0,0 +1,239 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include "util.h"
+#include "tcp_cc.h"
+
+/*
+ * BBR-style model based congestion control. It estimates the bottleneck
+ * bandwidth (the highest delivery rate of the last rounds) and the
+ * minimum RTT, paces at a gain over that bandwidth and keeps about two
+ * BDPs in flight. Loss is not taken as a congestion signal.
+ * Gains are fixed point with BBR_UNIT as 1.0.
+ */
+
+#define BBR_UNIT 256
+#define BBR_HIGH_GAIN (BBR_UNIT * 2885 / 1000 + 1) /* 2/ln(2), doubles the rate each round */
+#define BBR_DRAIN_GAIN (BBR_UNIT * 1000 / 2885)
+#define BBR_CWND_GAIN (BBR_UNIT * 2)
+#define BBR_CYCLE_LEN 8
+#define BBR_BW_ROUNDS 10 /* window of the bandwidth max filter */
+#define BBR_MIN_RTT_WIN 10000000 /* usec, window of the min RTT filter */
+#define BBR_PROBE_RTT_TIME 200000 /* usec */
+#define BBR_MIN_CWND_SEGS 4
+#define BBR_FULL_BW_GROWTH (BBR_UNIT * 5 / 4)
+#define BBR_FULL_BW_ROUNDS 3
+
+#define BBR_MODE_STARTUP   0
+#define BBR_MODE_DRAIN     1
+#define BBR_MODE_PROBE_BW  2
+#define BBR_MODE_PROBE_RTT 3
+
+static const uint16_t bbr_pacing_gain[BBR_CYCLE_LEN] = {
+    BBR_UNIT * 5 / 4, BBR_UNIT * 3 / 4, BBR_UNIT, BBR_UNIT, BBR_UNIT, BBR_UNIT, BBR_UNIT, BBR_UNIT
+};
+
+struct bbr {
+    uint32_t bw[BBR_BW_ROUNDS]; /* bytes/sec, highest delivery rate per round */
+    uint32_t round;
+    uint32_t min_rtt;       /* usec, 0 until the first sample */
+    uint64_t min_rtt_stamp;
+    uint64_t next_round_delivered;
+    uint64_t cycle_stamp;
+    uint64_t probe_rtt_done; /* 0 until inflight has drained in PROBE_RTT */
+    uint32_t full_bw;
+    uint32_t prior_cwnd;
+    uint16_t pacing_gain;
+    uint16_t cwnd_gain;
+    uint8_t mode;
+    uint8_t cycle;
+    uint8_t full_bw_cnt;
+    uint8_t full_bw_reached;
+};
+
+static void
+bbr_init (struct tcp_cc *cc) {
+    struct bbr *b = TCP_CC_PRIV(cc);
+    int n;
+
+    for (n = 0; n < BBR_BW_ROUNDS; n++) {
+        b->bw[n] = 0;
+    }
+    b->round = 0;
+    b->min_rtt = 0;
+    b->min_rtt_stamp = 0;
+    b->next_round_delivered = 0;
+    b->cycle_stamp = 0;
+    b->probe_rtt_done = 0;
+    b->full_bw = 0;
+    b->prior_cwnd = 0;
+    b->pacing_gain = BBR_HIGH_GAIN;
+    b->cwnd_gain = BBR_HIGH_GAIN;
+    b->mode = BBR_MODE_STARTUP;
+    b->cycle = 0;
+    b->full_bw_cnt = 0;
+    b->full_bw_reached = 0;
+    cc->pacing_rate = 0;
+}
+
+static uint32_t
+bbr_max_bw (struct bbr *b) {
+    uint32_t bw = 0;
+    int n;
+
+    for (n = 0; n < BBR_BW_ROUNDS; n++) {
+        bw = MAX(bw, b->bw[n]);
+    }
+    return bw;
+}
+
+/* the window that keeps gain * BDP in flight, 0 while the model is empty */
+static uint32_t
+bbr_target (struct tcp_cc *cc, uint32_t bw, uint16_t gain) {
+    struct bbr *b = TCP_CC_PRIV(cc);
+    uint64_t bdp;
+
+    if (!bw || !b->min_rtt) {
+        return 0;
+    }
+    bdp = (uint64_t)bw * b->min_rtt / 1000000;
+    bdp = bdp * gain / BBR_UNIT + 3 * cc->mss;
+    return (uint32_t)MIN(MAX(bdp, (uint64_t)BBR_MIN_CWND_SEGS * cc->mss), (uint64_t)TCP_CC_CWND_MAX);
+}
+
+/* STARTUP is over once the bandwidth stops growing by 25% per round */
+static void
+bbr_check_full_bw (struct bbr *b, uint32_t bw) {
+    if (b->full_bw_reached) {
+        return;
+    }
+    if ((uint64_t)bw * BBR_UNIT >= (uint64_t)b->full_bw * BBR_FULL_BW_GROWTH) {
+        b->full_bw = bw;
+        b->full_bw_cnt = 0;
+        return;
+    }
+    if (++b->full_bw_cnt >= BBR_FULL_BW_ROUNDS) {
+        b->full_bw_reached = 1;
+    }
+}
+
+static void
+bbr_enter_probe_bw (struct bbr *b, uint64_t now) {
+    b->mode = BBR_MODE_PROBE_BW;
+    b->cwnd_gain = BBR_CWND_GAIN;
+    /* start anywhere but in the draining phase */
+    b->cycle = BBR_CYCLE_LEN - 1 - random() % (BBR_CYCLE_LEN - 1);
+    b->cycle_stamp = now;
+}
+
+static void
+bbr_update_mode (struct tcp_cc *cc, const struct tcp_cc_ack *ack, uint32_t bw, int rtt_expired) {
+    struct bbr *b = TCP_CC_PRIV(cc);
+
+    switch (b->mode) {
+        case BBR_MODE_STARTUP:
+            if (b->full_bw_reached) {
+                b->mode = BBR_MODE_DRAIN;
+                b->pacing_gain = BBR_DRAIN_GAIN;
+                b->cwnd_gain = BBR_HIGH_GAIN;
+            }
+            break;
+        case BBR_MODE_DRAIN:
+            if (ack->inflight <= bbr_target(cc, bw, BBR_UNIT)) {
+                bbr_enter_probe_bw(b, ack->now);
+            }
+            break;
+        case BBR_MODE_PROBE_BW:
+            if (ack->now - b->cycle_stamp > b->min_rtt) {
+                b->cycle = (b->cycle + 1) % BBR_CYCLE_LEN;
+                b->cycle_stamp = ack->now;
+            }
+            break;
+        case BBR_MODE_PROBE_RTT:
+            if (!b->probe_rtt_done && ack->inflight <= BBR_MIN_CWND_SEGS * cc->mss) {
+                b->probe_rtt_done = ack->now + BBR_PROBE_RTT_TIME;
+            } else if (b->probe_rtt_done && ack->now >= b->probe_rtt_done) {
+                b->min_rtt_stamp = ack->now;
+                cc->cwnd = MAX(cc->cwnd, b->prior_cwnd);
+                if (b->full_bw_reached) {
+                    bbr_enter_probe_bw(b, ack->now);
+                } else {
+                    b->mode = BBR_MODE_STARTUP;
+                    b->pacing_gain = BBR_HIGH_GAIN;
+                    b->cwnd_gain = BBR_HIGH_GAIN;
+                }
+            }
+            break;
+    }
+    if (b->mode == BBR_MODE_PROBE_BW) {
+        b->pacing_gain = bbr_pacing_gain[b->cycle];
+    }
+    /* the min RTT has not been refreshed for a while, drain the queue to measure it */
+    if (b->mode != BBR_MODE_PROBE_RTT && rtt_expired) {
+        b->mode = BBR_MODE_PROBE_RTT;
+        b->pacing_gain = BBR_UNIT;
+        b->cwnd_gain = BBR_UNIT;
+        b->prior_cwnd = cc->cwnd;
+        b->probe_rtt_done = 0;
+    }
+}
+
+static void
+bbr_on_ack (struct tcp_cc *cc, const struct tcp_cc_ack *ack) {
+    struct bbr *b = TCP_CC_PRIV(cc);
+    uint32_t bw, target;
+    int round_start = 0, rtt_expired;
+
+    if (ack->prior_delivered >= b->next_round_delivered) {
+        b->next_round_delivered = ack->delivered;
+        b->round++;
+        b->bw[b->round % BBR_BW_ROUNDS] = 0;
+        round_start = 1;
+    }
+    if (ack->rate) {
+        b->bw[b->round % BBR_BW_ROUNDS] = MAX(b->bw[b->round % BBR_BW_ROUNDS], (uint32_t)MIN(ack->rate, (uint64_t)UINT32_MAX));
+    }
+    rtt_expired = b->min_rtt_stamp && ack->now - b->min_rtt_stamp > BBR_MIN_RTT_WIN;
+    if (ack->rtt && (!b->min_rtt || ack->rtt <= b->min_rtt || rtt_expired)) {
+        b->min_rtt = ack->rtt;
+        b->min_rtt_stamp = ack->now;
+    }
+    bw = bbr_max_bw(b);
+    if (round_start && bw) {
+        bbr_check_full_bw(b, bw);
+    }
+    bbr_update_mode(cc, ack, bw, rtt_expired);
+    cc->pacing_rate = (uint64_t)bw * b->pacing_gain / BBR_UNIT;
+    target = bbr_target(cc, bw, b->cwnd_gain);
+    if (!target || (!b->full_bw_reached && cc->cwnd < target)) {
+        /* grow as in slow start until the model says otherwise */
+        cc->cwnd = MIN(cc->cwnd + ack->acked, TCP_CC_CWND_MAX);
+    } else if (cc->cwnd < target) {
+        cc->cwnd = MIN(cc->cwnd + ack->acked, target);
+    } else if (b->full_bw_reached) {
+        cc->cwnd = target;
+    }
+    cc->cwnd = MAX(cc->cwnd, BBR_MIN_CWND_SEGS * cc->mss);
+    if (b->mode == BBR_MODE_PROBE_RTT) {
+        cc->cwnd = MIN(cc->cwnd, BBR_MIN_CWND_SEGS * cc->mss);
+    }
+}
+
+static void
+bbr_on_loss (struct tcp_cc *cc, uint32_t inflight) {
+    /* the model already bounds what is in flight */
+}
+
+static void
+bbr_on_rto (struct tcp_cc *cc, uint32_t inflight) {
+    /* restart from one segment, bbr_on_ack grows back to the model's window */
+    cc->cwnd = cc->mss;
+}
+
+struct tcp_cc_ops bbr_cc_ops = {
+    .name = "bbr",
+    .init = bbr_init,
+    .on_ack = bbr_on_ack,
+    .on_loss = bbr_on_loss,
+    .on_rto = bbr_on_rto
+};
@@ -0,0 +1,139 @@
+#include <stdio.h>
+#include <stdint.h>
+#include "util.h"
+#include "tcp_cc.h"
+
+/*
+ * CUBIC, see RFC 9438. In congestion avoidance the window follows
+ * W(t) = C * (t - K)^3 + W_max, so it grows quickly while far from the
+ * window at which the last loss happened and flattens out around it.
+ * Time is kept in msec and windows in bytes, without floating point.
+ */
+
+#define CUBIC_C_NUM      4 /* C = 0.4 segments/sec^3 */
+#define CUBIC_C_DEN      10
+#define CUBIC_BETA_NUM   7 /* beta = 0.7 */
+#define CUBIC_BETA_DEN   10
+#define CUBIC_ALPHA_1024 542 /* 3 * (1 - beta) / (1 + beta), Reno-friendly increase */
+#define CUBIC_OFFSET_MAX (1 << 20) /* msec, keeps (t - K)^3 within 64 bits */
+
+struct cubic {
+    uint32_t w_max;  /* bytes, window just before the last reduction */
+    uint32_t origin; /* bytes, plateau of the current curve */
+    uint32_t w_est;  /* bytes, what Reno would have reached */
+    uint32_t k;      /* msec, time from the epoch to the plateau */
+    uint32_t rem;    /* growth carried over between ACKs */
+    uint64_t epoch;  /* usec, start of congestion avoidance, 0 if not started */
+};
+
+static uint32_t
+cubic_cbrt (uint64_t x) {
+    uint64_t lo = 0, hi = 1 << 21, mid;
+
+    while (lo < hi) {
+        mid = (lo + hi + 1) / 2;
+        if (mid * mid * mid <= x) {
+            lo = mid;
+        } else {
+            hi = mid - 1;
+        }
+    }
+    return (uint32_t)lo;
+}
+
+static void
+cubic_init (struct tcp_cc *cc) {
+    struct cubic *c = TCP_CC_PRIV(cc);
+
+    c->w_max = 0;
+    c->origin = 0;
+    c->w_est = 0;
+    c->k = 0;
+    c->rem = 0;
+    c->epoch = 0;
+}
+
+static void
+cubic_epoch_start (struct tcp_cc *cc, uint64_t now) {
+    struct cubic *c = TCP_CC_PRIV(cc);
+    uint64_t segs;
+
+    c->epoch = now;
+    if (cc->cwnd < c->w_max) {
+        /* K = cbrt((W_max - cwnd) / C), in msec from 1/1024 segments */
+        segs = ((uint64_t)(c->w_max - cc->cwnd) << 10) / cc->mss;
+        c->k = cubic_cbrt(segs * (1000000000ULL * CUBIC_C_DEN / CUBIC_C_NUM >> 10));
+        c->origin = c->w_max;
+    } else {
+        c->k = 0;
+        c->origin = cc->cwnd;
+    }
+    c->w_est = cc->cwnd;
+    c->rem = 0;
+}
+
+static void
+cubic_on_ack (struct tcp_cc *cc, const struct tcp_cc_ack *ack) {
+    struct cubic *c = TCP_CC_PRIV(cc);
+    uint64_t t, offs, delta, target, inc;
+
+    if (ack->recovery || cc->cwnd >= TCP_CC_CWND_MAX) {
+        return;
+    }
+    if (cc->cwnd < cc->ssthresh) {
+        cc->cwnd += MIN(ack->acked, 2 * cc->mss);
+        return;
+    }
+    if (!c->epoch) {
+        cubic_epoch_start(cc, ack->now);
+    }
+    /* aim at where the curve will be one RTT from now */
+    t = (ack->now - c->epoch + ack->srtt) / 1000;
+    offs = MIN(t > c->k ? t - c->k : c->k - t, (uint64_t)CUBIC_OFFSET_MAX);
+    delta = offs * offs * offs / 1000000 * cc->mss * CUBIC_C_NUM / CUBIC_C_DEN / 1000;
+    if (t < c->k) {
+        target = c->origin > delta ? c->origin - delta : 0;
+    } else {
+        target = c->origin + delta;
+    }
+    c->w_est += (uint64_t)ack->acked * cc->mss * CUBIC_ALPHA_1024 / 1024 / cc->cwnd;
+    target = MAX(target, (uint64_t)c->w_est);
+    target = MIN(MAX(target, (uint64_t)cc->cwnd), (uint64_t)cc->cwnd * 3 / 2);
+    inc = (target - cc->cwnd) * ack->acked + c->rem;
+    c->rem = inc % cc->cwnd;
+    cc->cwnd = MIN(cc->cwnd + inc / cc->cwnd, TCP_CC_CWND_MAX);
+}
+
+static void
+cubic_reduce (struct tcp_cc *cc) {
+    struct cubic *c = TCP_CC_PRIV(cc);
+
+    if (cc->cwnd < c->w_max) {
+        /* fast convergence: release bandwidth to newer flows */
+        c->w_max = cc->cwnd * (CUBIC_BETA_DEN + CUBIC_BETA_NUM) / (2 * CUBIC_BETA_DEN);
+    } else {
+        c->w_max = cc->cwnd;
+    }
+    cc->ssthresh = MAX(cc->cwnd / CUBIC_BETA_DEN * CUBIC_BETA_NUM, 2 * cc->mss);
+    c->epoch = 0;
+}
+
+static void
+cubic_on_loss (struct tcp_cc *cc, uint32_t inflight) {
+    cubic_reduce(cc);
+    cc->cwnd = cc->ssthresh;
+}
+
+static void
+cubic_on_rto (struct tcp_cc *cc, uint32_t inflight) {
+    cubic_reduce(cc);
+    cc->cwnd = cc->mss;
+}
+
+struct tcp_cc_ops cubic_cc_ops = {
+    .name = "cubic",
+    .init = cubic_init,
+    .on_ack = cubic_on_ack,
+    .on_loss = cubic_on_loss,
+    .on_rto = cubic_on_rto
+};
@@ -0,0 +1,69 @@
+#include <stdio.h>
+#include <stdint.h>
+#include "util.h"
+#include "tcp_cc.h"
+
+/* slow start and congestion avoidance, see RFC 5681 */
+
+struct newreno {
+    uint32_t acked; /* bytes acknowledged since cwnd last grew in congestion avoidance */
+};
+
+static void
+newreno_init (struct tcp_cc *cc) {
+    struct newreno *nr = TCP_CC_PRIV(cc);
+
+    nr->acked = 0;
+}
+
+static void
+newreno_on_ack (struct tcp_cc *cc, const struct tcp_cc_ack *ack) {
+    struct newreno *nr = TCP_CC_PRIV(cc);
+
+    if (ack->recovery || cc->cwnd >= TCP_CC_CWND_MAX) {
+        /* the window does not grow during fast recovery */
+        return;
+    }
+    if (cc->cwnd < cc->ssthresh) {
+        /* byte counting limited to 2*SMSS per ACK (RFC 3465) */
+        cc->cwnd += MIN(ack->acked, 2 * cc->mss);
+        return;
+    }
+    nr->acked += ack->acked;
+    if (nr->acked >= cc->cwnd) {
+        nr->acked -= cc->cwnd;
+        cc->cwnd += cc->mss;
+    }
+}
+
+/* RFC 5681 (4) */
+static uint32_t
+newreno_ssthresh (struct tcp_cc *cc, uint32_t inflight) {
+    return MAX(inflight / 2, 2 * cc->mss);
+}
+
+static void
+newreno_on_loss (struct tcp_cc *cc, uint32_t inflight) {
+    struct newreno *nr = TCP_CC_PRIV(cc);
+
+    cc->ssthresh = newreno_ssthresh(cc, inflight);
+    cc->cwnd = cc->ssthresh;
+    nr->acked = 0;
+}
+
+static void
+newreno_on_rto (struct tcp_cc *cc, uint32_t inflight) {
+    struct newreno *nr = TCP_CC_PRIV(cc);
+
+    cc->ssthresh = newreno_ssthresh(cc, inflight);
+    cc->cwnd = cc->mss; /* loss window */
+    nr->acked = 0;
+}
+
+struct tcp_cc_ops newreno_cc_ops = {
+    .name = "newreno",
+    .init = newreno_init,
+    .on_ack = newreno_on_ack,
+    .on_loss = newreno_on_loss,
+    .on_rto = newreno_on_rto
+};
@@ -2,6 +2,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <inttypes.h>
+#include <sys/uio.h>
 #include <rte_eal.h>
 #include <rte_ethdev.h>
 #include <rte_cycles.h>
@@ -20,6 +21,9 @@
 
 struct raw_device {
     uint16_t port;
+    /* mbufs handed out by raw_rx_burst(), freed on the next call */
+    struct rte_mbuf *held[BURST_SIZE];
+    uint16_t nb_held;
 };
 
 struct rte_mempool *mbuf_pool;
@@ -132,6 +136,7 @@ raw_open (const char *name) {
         return NULL;
     }
     dev->port = (uint16_t)atoi(name);
+    dev->nb_held = 0;
     if (port_init(dev->port) < 0){
         free(dev);
         return NULL;
@@ -191,9 +196,111 @@ raw_tx (struct raw_device *dev, const uint8_t *buffer, size_t length) {
     return -1;
 }
 
+int
+raw_rx_burst (struct raw_device *dev, struct iovec *frames, int num, int timeout) {
+    uint16_t i;
+
+    for (i = 0; i < dev->nb_held; i++) {
+        rte_pktmbuf_free(dev->held[i]);
+    }
+    dev->nb_held = rte_eth_rx_burst(dev->port, 0, dev->held, num < BURST_SIZE ? num : BURST_SIZE);
+    for (i = 0; i < dev->nb_held; i++) {
+        frames[i].iov_base = rte_pktmbuf_mtod(dev->held[i], uint8_t *);
+        frames[i].iov_len = rte_pktmbuf_pkt_len(dev->held[i]);
+    }
+    return dev->nb_held;
+}
+
+int
+raw_tx_burst (struct raw_device *dev, const struct iovec *frames, int num) {
+    struct rte_mbuf *bufs[BURST_SIZE];
+    uint16_t nb_tx, i;
+
+    if (num > BURST_SIZE) {
+        num = BURST_SIZE;
+    }
+    for (i = 0; i < num; i++) {
+        bufs[i] = rte_pktmbuf_alloc(mbuf_pool);
+        if (!bufs[i]) {
+            break;
+        }
+        bufs[i]->pkt_len = frames[i].iov_len;
+        bufs[i]->data_len = frames[i].iov_len;
+        bufs[i]->port = dev->port;
+        memcpy(rte_pktmbuf_mtod(bufs[i], uint8_t *), frames[i].iov_base, frames[i].iov_len);
+    }
+    /* Send the whole burst with one call */
+    nb_tx = rte_eth_tx_burst(dev->port, 0, bufs, i);
+    while (nb_tx < i) {
+        rte_pktmbuf_free(bufs[--i]);
+    }
+    return nb_tx;
+}
+
 int
 raw_addr (const char *name, uint8_t *dst, size_t size) {
     struct ether_addr addr;
 
-    rte_eth_macaddr_get(port, &addr);
+    rte_eth_macaddr_get((uint16_t)atoi(name), &addr);
+    memcpy(dst, addr.addr_bytes, size < sizeof(addr.addr_bytes) ? size : sizeof(addr.addr_bytes));
+    return 0;
+}
+
+static int
+dpdk_dev_open_wrap (struct rawdev *dev) {
+    dev->priv = raw_open(dev->name);
+    return dev->priv ? 0 : -1;
 }
+
+static void
+dpdk_dev_close_wrap (struct rawdev *dev) {
+    raw_close(dev->priv);
+}
+
+static void
+dpdk_dev_rx_wrap (struct rawdev *dev, void (*callback)(uint8_t *, size_t, void *), void *arg, int timeout) {
+    raw_rx(dev->priv, callback, arg, timeout);
+}
+
+static ssize_t
+dpdk_dev_tx_wrap (struct rawdev *dev, struct pkbuf *pkb) {
+    return raw_tx(dev->priv, pkb->data, pkb->len);
+}
+
+static int
+dpdk_dev_rx_burst_wrap (struct rawdev *dev, struct iovec *frames, int num, int timeout) {
+    return raw_rx_burst(dev->priv, frames, num, timeout);
+}
+
+static int
+dpdk_dev_tx_burst_wrap (struct rawdev *dev, struct pkbuf **pkbs, int num) {
+    struct iovec frames[BURST_SIZE];
+    int done, idx, ret;
+
+    for (done = 0; done < num; done += ret) {
+        for (idx = 0; idx < num - done && idx < BURST_SIZE; idx++) {
+            frames[idx].iov_base = pkbs[done + idx]->data;
+            frames[idx].iov_len = pkbs[done + idx]->len;
+        }
+        ret = raw_tx_burst(dev->priv, frames, idx);
+        if (ret < idx) {
+            return done + ret;
+        }
+    }
+    return done;
+}
+
+static int
+dpdk_dev_addr_wrap (struct rawdev *dev, uint8_t *dst, size_t size) {
+    return raw_addr(dev->name, dst, size);
+}
+
+struct rawdev_ops dpdk_dev_ops = {
+    .open = dpdk_dev_open_wrap,
+    .close = dpdk_dev_close_wrap,
+    .rx = dpdk_dev_rx_wrap,
+    .tx = dpdk_dev_tx_wrap,
+    .rx_burst = dpdk_dev_rx_burst_wrap,
+    .tx_burst = dpdk_dev_tx_burst_wrap,
+    .addr = dpdk_dev_addr_wrap
+};
@@ -9,6 +9,8 @@
 #include "net.h"
 #include "ethernet.h"
 
+#define ETHERNET_BURST_MAX 32
+
 struct ethernet_hdr {
     uint8_t dst[ETHERNET_ADDR_LEN];
     uint8_t src[ETHERNET_ADDR_LEN];
@@ -164,11 +166,20 @@ static void *
 ethernet_rx_thread (void *arg) {
     struct netdev *dev;
     struct ethernet_priv *priv;
+    struct iovec frames[ETHERNET_BURST_MAX];
+    int num, idx;
 
     dev = (struct netdev *)arg;
     priv = (struct ethernet_priv *)dev->priv;
     while (!priv->terminate) {
-        priv->raw->ops->rx(priv->raw, ethernet_rx, dev, 1000);
+        if (priv->raw->ops->rx_burst) {
+            num = priv->raw->ops->rx_burst(priv->raw, frames, ETHERNET_BURST_MAX, 1000);
+            for (idx = 0; idx < num; idx++) {
+                ethernet_rx(frames[idx].iov_base, frames[idx].iov_len, dev);
+            }
+        } else {
+            priv->raw->ops->rx(priv->raw, ethernet_rx, dev, 1000);
+        }
     }
     return NULL;
 }
@@ -199,29 +210,71 @@ ethernet_stop (struct netdev *dev) {
     return 0;
 }
 
-static ssize_t
-ethernet_tx (struct netdev *dev, uint16_t type, const uint8_t *payload, size_t plen, const void *dst) {
-    struct ethernet_priv *priv;
-    uint8_t frame[ETHERNET_FRAME_SIZE_MAX];
+static int
+ethernet_tx_prepare (struct netdev *dev, uint16_t type, struct pkbuf *pkb, const void *dst) {
     struct ethernet_hdr *hdr;
-    size_t flen;
+    uint8_t *pad;
+    size_t plen;
 
-    priv = (struct ethernet_priv *)dev->priv;
-    if (!payload || plen > ETHERNET_PAYLOAD_SIZE_MAX || !dst) {
+    if (!pkb || pkb->len > ETHERNET_PAYLOAD_SIZE_MAX || !dst) {
+        return -1;
+    }
+    plen = pkb->len;
+    if (plen < ETHERNET_PAYLOAD_SIZE_MIN) {
+        pad = pkbuf_put(pkb, ETHERNET_PAYLOAD_SIZE_MIN - plen);
+        if (!pad) {
+            return -1;
+        }
+        memset(pad, 0, ETHERNET_PAYLOAD_SIZE_MIN - plen);
+    }
+    hdr = (struct ethernet_hdr *)pkbuf_push(pkb, sizeof(struct ethernet_hdr));
+    if (!hdr) {
         return -1;
     }
-    memset(frame, 0, sizeof(frame));
-    hdr = (struct ethernet_hdr *)frame;
     memcpy(hdr->dst, dst, ETHERNET_ADDR_LEN);
     memcpy(hdr->src, dev->addr, ETHERNET_ADDR_LEN);
     hdr->type = hton16(type);
-    memcpy(hdr + 1, payload, plen);
-    flen = sizeof(struct ethernet_hdr) + (plen < ETHERNET_PAYLOAD_SIZE_MIN ? ETHERNET_PAYLOAD_SIZE_MIN : plen);
 #ifdef DEBUG
     fprintf(stderr, ">>> ethernet_tx <<<\n");
-    ethernet_dump(dev, frame, flen);
+    ethernet_dump(dev, pkb->data, pkb->len);
 #endif
-    return priv->raw->ops->tx(priv->raw, frame, flen) == (ssize_t)flen ? (ssize_t)plen : -1;
+    return 0;
+}
+
+static ssize_t
+ethernet_tx (struct netdev *dev, uint16_t type, struct pkbuf *pkb, const void *dst) {
+    struct ethernet_priv *priv;
+    size_t plen;
+
+    priv = (struct ethernet_priv *)dev->priv;
+    plen = pkb ? pkb->len : 0;
+    if (ethernet_tx_prepare(dev, type, pkb, dst) == -1) {
+        return -1;
+    }
+    return priv->raw->ops->tx(priv->raw, pkb) == (ssize_t)pkb->len ? (ssize_t)plen : -1;
+}
+
+static int
+ethernet_tx_burst (struct netdev *dev, uint16_t type, struct pkbuf **pkbs, int num, const void *dst) {
+    struct ethernet_priv *priv;
+    int idx;
+
+    priv = (struct ethernet_priv *)dev->priv;
+    for (idx = 0; idx < num; idx++) {
+        if (ethernet_tx_prepare(dev, type, pkbs[idx], dst) == -1) {
+            num = idx;
+            break;
+        }
+    }
+    if (priv->raw->ops->tx_burst) {
+        return priv->raw->ops->tx_burst(priv->raw, pkbs, num);
+    }
+    for (idx = 0; idx < num; idx++) {
+        if (priv->raw->ops->tx(priv->raw, pkbs[idx]) != (ssize_t)pkbs[idx]->len) {
+            break;
+        }
+    }
+    return idx;
 }
 
 struct netdev_ops ethernet_ops = {
@@ -229,7 +282,8 @@ struct netdev_ops ethernet_ops = {
     .close = ethernet_close,
     .run = ethernet_run,
     .stop = ethernet_stop,
-    .tx = ethernet_tx
+    .tx = ethernet_tx,
+    .tx_burst = ethernet_tx_burst
 };
 
 struct netdev_def ethernet_def = {
@@ -120,23 +120,33 @@ icmp_rx (uint8_t *packet, size_t plen, ip_addr_t *src, ip_addr_t *dst, struct ne
 
 int
 icmp_tx (struct netif *netif, uint8_t type, uint8_t code, uint32_t values, uint8_t *data, size_t len, ip_addr_t *dst) {
-    uint8_t buf[ICMP_BUFSIZ];
+    struct pkbuf *pkb;
     struct icmp_hdr *hdr;
     size_t msg_len;
+    int ret;
 
-    hdr = (struct icmp_hdr *)buf;
+    if (len > ICMP_BUFSIZ - sizeof(struct icmp_hdr)) {
+        return -1;
+    }
+    pkb = pkbuf_alloc(sizeof(struct icmp_hdr) + len);
+    if (!pkb) {
+        return -1;
+    }
+    memcpy(pkbuf_put(pkb, len), data, len);
+    hdr = (struct icmp_hdr *)pkbuf_push(pkb, sizeof(struct icmp_hdr));
     hdr->type = type;
     hdr->code = code;
     hdr->sum = 0;
     hdr->ih_values = values;
-    memcpy(hdr->data, data, len);
     msg_len = sizeof(struct icmp_hdr) + len;
     hdr->sum = cksum16((uint16_t *)hdr, msg_len, 0);
 #ifdef DEBUG
     fprintf(stderr, ">>> icmp_tx <<<\n");
     icmp_dump(netif, NULL, dst, (uint8_t *)hdr, msg_len);
 #endif
-    return ip_tx(netif, IP_PROTOCOL_ICMP, (uint8_t *)hdr, msg_len, dst);
+    ret = ip_tx(netif, IP_PROTOCOL_ICMP, pkb, dst);
+    pkbuf_free(pkb);
+    return ret;
 }
 
 int
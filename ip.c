@@ -12,6 +12,7 @@
 #define IP_FRAGMENT_TIMEOUT_SEC 30
 #define IP_FRAGMENT_NUM_MAX 8
 #define IP_ROUTE_TABLE_SIZE 8
+#define IP_TX_BURST_MAX 32
 
 struct ip_route {
     uint8_t used;
@@ -42,7 +43,7 @@ struct ip_protocol {
 static void
 ip_rx (uint8_t *dgram, size_t dlen, struct netdev *dev);
 static int
-ip_tx_netdev (struct netif *netif, uint8_t *packet, size_t plen, const ip_addr_t *dst);
+ip_tx_netdev (struct netif *netif, struct pkbuf *pkb, const ip_addr_t *dst);
 
 static struct ip_route route_table[IP_ROUTE_TABLE_SIZE];
 static struct ip_protocol *protocols;
@@ -420,6 +421,7 @@ static int
 ip_forward_process (uint8_t *dgram, size_t dlen, struct netif *netif) {
     struct ip_hdr *hdr;
     struct ip_route *route;
+    struct pkbuf *pkb;
     uint16_t sum;
     int ret;
 
@@ -442,10 +444,16 @@ ip_forward_process (uint8_t *dgram, size_t dlen, struct netif *netif) {
         icmp_tx(netif, ICMP_TYPE_DEST_UNREACH, ICMP_CODE_FRAGMENT_NEEDED, 0, dgram, ICMP_COPY_LEN(hdr), &hdr->src);
         return -1;
     }
+    pkb = pkbuf_alloc(dlen);
+    if (!pkb) {
+        return -1;
+    }
     hdr->ttl--;
     sum = hdr->sum;
     hdr->sum = cksum16((uint16_t *)hdr, (hdr->vhl & 0x0f) << 2, -hdr->sum);
-    ret = ip_tx_netdev(route->netif, dgram, dlen, route->nexthop ? &route->nexthop : &hdr->dst);
+    memcpy(pkbuf_put(pkb, dlen), dgram, dlen);
+    ret = ip_tx_netdev(route->netif, pkb, route->nexthop ? &route->nexthop : &hdr->dst);
+    pkbuf_free(pkb);
     if (ret == -1) {
         hdr->ttl++; hdr->sum = sum; /* Restore original IP Header */
         icmp_tx(netif, ICMP_TYPE_DEST_UNREACH, route->nexthop ? ICMP_CODE_NET_UNREACH : ICMP_CODE_HOST_UNREACH, 0, dgram, ICMP_COPY_LEN(hdr), &hdr->src);
@@ -529,13 +537,15 @@ ip_rx (uint8_t *dgram, size_t dlen, struct netdev *dev) {
 }
 
 static int
-ip_tx_netdev (struct netif *netif, uint8_t *packet, size_t plen, const ip_addr_t *dst) {
+ip_tx_netdev (struct netif *netif, struct pkbuf *pkb, const ip_addr_t *dst) {
     ssize_t ret;
+    size_t plen;
     uint8_t ha[128] = {};
 
+    plen = pkb->len;
     if (!(netif->dev->flags & NETDEV_FLAG_NOARP)) {
         if (dst) {
-            ret = arp_resolve(netif, dst, (void *)ha, packet, plen);
+            ret = arp_resolve(netif, dst, (void *)ha, pkb);
             if (ret != 1) {
                 return ret;
             }
@@ -543,20 +553,52 @@ ip_tx_netdev (struct netif *netif, uint8_t *packet, size_t plen, const ip_addr_t
             memcpy(ha, netif->dev->broadcast, netif->dev->alen);
         }
     }
-    if (netif->dev->ops->tx(netif->dev, ETHERNET_TYPE_IP, packet, plen, (void *)ha) != (ssize_t)plen) {
+    if (netif->dev->ops->tx(netif->dev, ETHERNET_TYPE_IP, pkb, (void *)ha) != (ssize_t)plen) {
         return -1;
     }
     return 1;
 }
 
 static int
-ip_tx_core (struct netif *netif, uint8_t protocol, const uint8_t *buf, size_t len, const ip_addr_t *src, const ip_addr_t *dst, const ip_addr_t *nexthop, uint16_t id, uint16_t offset) {
-    uint8_t packet[4096];
+ip_tx_netdev_burst (struct netif *netif, struct pkbuf **pkbs, int num, const ip_addr_t *dst) {
+    uint8_t ha[128] = {};
+    int idx, ret;
+
+    if (netif->dev->ops->tx_burst && num > 1) {
+        ret = ARP_RESOLVE_FOUND;
+        if (!(netif->dev->flags & NETDEV_FLAG_NOARP)) {
+            if (dst) {
+                ret = arp_resolve(netif, dst, (void *)ha, NULL);
+            } else {
+                memcpy(ha, netif->dev->broadcast, netif->dev->alen);
+            }
+        }
+        if (ret == ARP_RESOLVE_FOUND) {
+            return netif->dev->ops->tx_burst(netif->dev, ETHERNET_TYPE_IP, pkbs, num, (void *)ha) == num ? 1 : -1;
+        }
+        /* not resolved yet, the per-packet path waits for the reply */
+    }
+    for (idx = 0; idx < num; idx++) {
+        ret = ip_tx_netdev(netif, pkbs[idx], dst);
+        if (ret != 1) {
+            return ret;
+        }
+    }
+    return 1;
+}
+
+static int
+ip_hdr_push (struct netif *netif, uint8_t protocol, struct pkbuf *pkb, const ip_addr_t *src, const ip_addr_t *dst, uint16_t id, uint16_t offset) {
     struct ip_hdr *hdr;
     uint16_t hlen;
+    size_t len;
 
-    hdr = (struct ip_hdr *)packet;
+    len = pkb->len;
     hlen = sizeof(struct ip_hdr);
+    hdr = (struct ip_hdr *)pkbuf_push(pkb, hlen);
+    if (!hdr) {
+        return -1;
+    }
     hdr->vhl = (IP_VERSION_IPV4 << 4) | (hlen >> 2);
     hdr->tos = 0;
     hdr->len = hton16(hlen + len);
@@ -568,12 +610,59 @@ ip_tx_core (struct netif *netif, uint8_t protocol, const uint8_t *buf, size_t le
     hdr->src = src ? *src : ((struct netif_ip *)netif)->unicast;
     hdr->dst = *dst;
     hdr->sum = cksum16((uint16_t *)hdr, hlen, 0);
-    memcpy(hdr + 1, buf, len);
 #ifdef DEBUG
     fprintf(stderr, ">>> ip_tx_core <<<\n");
-    ip_dump(netif, (uint8_t *)packet, hlen + len);
+    ip_dump(netif, pkb->data, pkb->len);
 #endif
-    return ip_tx_netdev(netif, (uint8_t *)packet, hlen + len, nexthop);
+    return 0;
+}
+
+static int
+ip_tx_core (struct netif *netif, uint8_t protocol, struct pkbuf *pkb, const ip_addr_t *src, const ip_addr_t *dst, const ip_addr_t *nexthop, uint16_t id, uint16_t offset) {
+    if (ip_hdr_push(netif, protocol, pkb, src, dst, id, offset) == -1) {
+        return -1;
+    }
+    return ip_tx_netdev(netif, pkb, nexthop);
+}
+
+static int
+ip_tx_fragments (struct netif *netif, uint8_t protocol, struct pkbuf *pkb, const ip_addr_t *src, const ip_addr_t *dst, const ip_addr_t *nexthop, uint16_t id) {
+    struct pkbuf *frags[IP_TX_BURST_MAX];
+    size_t len, done, slen;
+    uint16_t flag, offset;
+    int num = 0, idx, ret = 1;
+
+    len = pkb->len;
+    for (done = 0; done < len; done += slen) {
+        slen = MIN((len - done), (size_t)((netif->dev->mtu - IP_HDR_SIZE_MIN) & ~7));
+        flag = ((done + slen) < len) ? 0x2000 : 0x0000;
+        offset = flag | ((done >> 3) & 0x1fff);
+        frags[num] = pkbuf_alloc(slen);
+        if (!frags[num]) {
+            ret = -1;
+            break;
+        }
+        memcpy(pkbuf_put(frags[num], slen), pkb->data + done, slen);
+        if (ip_hdr_push(netif, protocol, frags[num++], src, dst, id, offset) == -1) {
+            ret = -1;
+            break;
+        }
+        if (num == IP_TX_BURST_MAX || done + slen == len) {
+            /* hand the whole fragment train to the device at once */
+            ret = ip_tx_netdev_burst(netif, frags, num, nexthop);
+            for (idx = 0; idx < num; idx++) {
+                pkbuf_free(frags[idx]);
+            }
+            num = 0;
+            if (ret == -1) {
+                break;
+            }
+        }
+    }
+    for (idx = 0; idx < num; idx++) {
+        pkbuf_free(frags[idx]);
+    }
+    return ret;
 }
 
 static uint16_t
@@ -589,11 +678,11 @@ ip_generate_id (void) {
 }
 
 ssize_t
-ip_tx (struct netif *netif, uint8_t protocol, const uint8_t *buf, size_t len, const ip_addr_t *dst) {
+ip_tx (struct netif *netif, uint8_t protocol, struct pkbuf *pkb, const ip_addr_t *dst) {
     struct ip_route *route;
     ip_addr_t *nexthop = NULL, *src = NULL;
-    uint16_t id, flag, offset;
-    size_t done, slen;
+    uint16_t id;
+    size_t len;
 
     if (netif && *dst == IP_ADDR_BROADCAST) {
         nexthop = NULL;
@@ -610,13 +699,16 @@ ip_tx (struct netif *netif, uint8_t protocol, const uint8_t *buf, size_t len, co
         nexthop = (ip_addr_t *)(route->nexthop ? &route->nexthop : dst);
     }
     id = ip_generate_id();
-    for (done = 0; done < len; done += slen) {
-        slen = MIN((len - done), (size_t)(netif->dev->mtu - IP_HDR_SIZE_MIN));
-        flag = ((done + slen) < len) ? 0x2000 : 0x0000;
-        offset = flag | ((done >> 3) & 0x1fff);
-        if (ip_tx_core(netif, protocol, buf + done, slen, src, dst, nexthop, id, offset) == -1) {
+    len = pkb->len;
+    if (len <= (size_t)(netif->dev->mtu - IP_HDR_SIZE_MIN)) {
+        /* fast path: prepend the header in place */
+        if (ip_tx_core(netif, protocol, pkb, src, dst, nexthop, id, 0) == -1) {
             return -1;
         }
+        return len;
+    }
+    if (ip_tx_fragments(netif, protocol, pkb, src, dst, nexthop, id) == -1) {
+        return -1;
     }
     return len;
 }
@@ -67,7 +67,7 @@ ip_netif_by_peer (ip_addr_t *peer);
 extern int
 ip_set_forwarding (int mode);
 extern ssize_t
-ip_tx (struct netif *netif, uint8_t protocol, const uint8_t *buf, size_t len, const ip_addr_t *addr);
+ip_tx (struct netif *netif, uint8_t protocol, struct pkbuf *pkb, const ip_addr_t *addr);
 extern int
 ip_add_protocol (uint8_t protocol, void (*handler)(uint8_t *, size_t, ip_addr_t *, ip_addr_t *, struct netif *));
 extern int
@@ -2,6 +2,7 @@
 #define NET_H
 
 #include <stdint.h>
+#include "pkbuf.h"
 
 #define NETDEV_TYPE_ETHERNET  (0x0001)
 #define NETDEV_TYPE_SLIP      (0x0002)
@@ -41,7 +42,9 @@ struct netdev_ops {
     int (*close)(struct netdev *dev);
     int (*run)(struct netdev *dev);
     int (*stop)(struct netdev *dev);
-    ssize_t (*tx)(struct netdev *dev, uint16_t type, const uint8_t *packet, size_t size, const void *dst);
+    ssize_t (*tx)(struct netdev *dev, uint16_t type, struct pkbuf *pkb, const void *dst);
+    /* optional: send packets of the same type to the same destination, returns the number sent */
+    int (*tx_burst)(struct netdev *dev, uint16_t type, struct pkbuf **pkbs, int num, const void *dst);
 };
 
 struct netdev_def {
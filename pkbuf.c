@@ -0,0 +1,75 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include "util.h"
+#include "pkbuf.h"
+
+/*
+ * The data area starts empty just behind the headroom. Upper layers
+ * append their payload with pkbuf_put() and each layer on the way down
+ * prepends its header with pkbuf_push(), so the payload is written once.
+ */
+struct pkbuf *
+pkbuf_alloc (size_t size) {
+    struct pkbuf *pkb;
+    size_t total;
+
+    total = PKBUF_HEADROOM + MAX(size, (size_t)PKBUF_TAILROOM_MIN);
+    pkb = malloc(sizeof(struct pkbuf) + total);
+    if (!pkb) {
+        return NULL;
+    }
+    pkb->ref = 1;
+    pkb->size = total;
+    pkb->data = pkb->buf + PKBUF_HEADROOM;
+    pkb->len = 0;
+    return pkb;
+}
+
+struct pkbuf *
+pkbuf_ref (struct pkbuf *pkb) {
+    __sync_add_and_fetch(&pkb->ref, 1);
+    return pkb;
+}
+
+void
+pkbuf_free (struct pkbuf *pkb) {
+    if (!pkb) {
+        return;
+    }
+    if (__sync_sub_and_fetch(&pkb->ref, 1) == 0) {
+        free(pkb);
+    }
+}
+
+uint8_t *
+pkbuf_push (struct pkbuf *pkb, size_t len) {
+    if (pkbuf_headroom(pkb) < len) {
+        return NULL;
+    }
+    pkb->data -= len;
+    pkb->len += len;
+    return pkb->data;
+}
+
+uint8_t *
+pkbuf_pull (struct pkbuf *pkb, size_t len) {
+    if (pkb->len < len) {
+        return NULL;
+    }
+    pkb->data += len;
+    pkb->len -= len;
+    return pkb->data;
+}
+
+uint8_t *
+pkbuf_put (struct pkbuf *pkb, size_t len) {
+    uint8_t *tail;
+
+    if (pkbuf_tailroom(pkb) < len) {
+        return NULL;
+    }
+    tail = pkb->data + pkb->len;
+    pkb->len += len;
+    return tail;
+}
@@ -0,0 +1,39 @@
+#ifndef PKBUF_H
+#define PKBUF_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Reserved in front of the data area so that every layer below the
+ * transport (IP options included) can prepend its header in place.
+ */
+#define PKBUF_HEADROOM 128
+/* Minimum room behind the data area (enough to pad a short Ethernet frame) */
+#define PKBUF_TAILROOM_MIN 64
+
+struct pkbuf {
+    int ref;
+    size_t size;
+    uint8_t *data;
+    size_t len;
+    uint8_t buf[0];
+};
+
+#define pkbuf_headroom(x) ((size_t)((x)->data - (x)->buf))
+#define pkbuf_tailroom(x) ((x)->size - (pkbuf_headroom(x) + (x)->len))
+
+extern struct pkbuf *
+pkbuf_alloc (size_t size);
+extern struct pkbuf *
+pkbuf_ref (struct pkbuf *pkb);
+extern void
+pkbuf_free (struct pkbuf *pkb);
+extern uint8_t *
+pkbuf_push (struct pkbuf *pkb, size_t len);
+extern uint8_t *
+pkbuf_pull (struct pkbuf *pkb, size_t len);
+extern uint8_t *
+pkbuf_put (struct pkbuf *pkb, size_t len);
+
+#endif
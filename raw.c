@@ -21,11 +21,21 @@ extern struct rawdev_ops soc_dev_ops;
 extern struct rawdev_ops bpf_dev_ops;
 #endif
 
+#ifdef USE_DPDK
+extern struct rawdev_ops dpdk_dev_ops;
+#endif
+
 static uint8_t
 rawdev_detect_type (char *name) {
     if (strncmp(name, "tap", 3) == 0) {
         return RAWDEV_TYPE_TAP;
     }
+#ifdef USE_DPDK
+    /* DPDK devices are named by port number */
+    if (name[0] >= '0' && name[0] <= '9') {
+        return RAWDEV_TYPE_DPDK;
+    }
+#endif
     return RAWDEV_TYPE_DEFAULT;
 }
 
@@ -52,6 +62,11 @@ rawdev_alloc (uint8_t type, char *name) {
     case RAWDEV_TYPE_BPF:
         ops = &bpf_dev_ops;
         break;
+#endif
+#ifdef USE_DPDK
+    case RAWDEV_TYPE_DPDK:
+        ops = &dpdk_dev_ops;
+        break;
 #endif
     default:
         fprintf(stderr, "unsupported raw device type (%u)\n", type);
@@ -4,12 +4,15 @@
 #include <stddef.h>
 #include <stdint.h>
 #include <net/if.h>
+#include <sys/uio.h>
 #include "net.h"
+#include "pkbuf.h"
 
 #define RAWDEV_TYPE_AUTO 0
 #define RAWDEV_TYPE_TAP 1
 #define RAWDEV_TYPE_SOCKET 2
 #define RAWDEV_TYPE_BPF 3
+#define RAWDEV_TYPE_DPDK 4
 
 struct rawdev;
 
@@ -17,7 +20,10 @@ struct rawdev_ops {
     int (*open)(struct rawdev *raw);
     void (*close)(struct rawdev *raw);
     void (*rx)(struct rawdev *raw, void (*callback)(uint8_t *, size_t, void *), void *arg, int timeout);
-    ssize_t (*tx)(struct rawdev *raw, const uint8_t *buf, size_t len);
+    ssize_t (*tx)(struct rawdev *raw, struct pkbuf *pkb);
+    /* optional: frames returned by rx_burst stay valid until the next call */
+    int (*rx_burst)(struct rawdev *raw, struct iovec *frames, int num, int timeout);
+    int (*tx_burst)(struct rawdev *raw, struct pkbuf **pkbs, int num);
     int (*addr)(struct rawdev *raw, uint8_t *dst, size_t size);
 };
 
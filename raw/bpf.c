@@ -22,6 +22,9 @@ struct bpf_dev {
     int fd;
     int size;
     char *buf;
+    /* frames read but not yet returned by bpf_dev_rx_burst() */
+    caddr_t next;
+    ssize_t remain;
 };
 
 int
@@ -39,6 +42,8 @@ bpf_dev_open (char *name) {
     dev->fd = -1;
     dev->size = 0;
     dev->buf = NULL;
+    dev->next = NULL;
+    dev->remain = 0;
     for (index = 0; index < BPF_DEVICE_NUM; index++) {
         snprintf(path, sizeof(path), "/dev/bpf%d", index);
         dev->fd = open(path, O_RDWR, 0);
@@ -134,6 +139,49 @@ bpf_dev_rx (struct bpf_dev *dev, void (*callback)(uint8_t *, size_t, void *), vo
     }
 }
 
+/*
+ * A single read() returns every captured frame, so the burst simply hands
+ * them out from the buffer. Frames stay valid until the next call.
+ */
+int
+bpf_dev_rx_burst (struct bpf_dev *dev, struct iovec *frames, int num, int timeout) {
+    struct pollfd pfd;
+    int ret, count = 0;
+    ssize_t len;
+    struct bpf_hdr *hdr;
+
+    if (dev->remain <= 0) {
+        pfd.fd = dev->fd;
+        pfd.events = POLLIN;
+        ret = poll(&pfd, 1, timeout);
+        if (ret <= 0) {
+            if (ret == -1 && errno != EINTR) {
+                perror("poll");
+            }
+            return 0;
+        }
+        len = read(dev->fd, dev->buf, dev->size);
+        if (len <= 0) {
+            if (len == -1 && errno != EINTR) {
+                perror("read");
+            }
+            return 0;
+        }
+        dev->next = dev->buf;
+        dev->remain = len;
+    }
+    while (dev->remain > 0 && count < num) {
+        hdr = (struct bpf_hdr *)dev->next;
+        frames[count].iov_base = (caddr_t)hdr + hdr->bh_hdrlen;
+        frames[count].iov_len = hdr->bh_caplen;
+        count++;
+        len = BPF_WORDALIGN(hdr->bh_hdrlen + hdr->bh_caplen);
+        dev->next += len;
+        dev->remain -= len;
+    }
+    return count;
+}
+
 ssize_t
 bpf_dev_tx (struct bpf_dev *dev, const uint8_t *buf, size_t len) {
     return write(dev->fd, buf, len);
@@ -179,8 +227,13 @@ bpf_dev_rx_wrap (struct rawdev *dev, void (*callback)(uint8_t *, size_t, void *)
 }
 
 static ssize_t
-bpf_dev_tx_wrap (struct rawdev *dev, const uint8_t *buf, size_t len) {
-    return bpf_dev_tx(dev->priv, buf, len);
+bpf_dev_tx_wrap (struct rawdev *dev, struct pkbuf *pkb) {
+    return bpf_dev_tx(dev->priv, pkb->data, pkb->len);
+}
+
+static int
+bpf_dev_rx_burst_wrap (struct rawdev *dev, struct iovec *frames, int num, int timeout) {
+    return bpf_dev_rx_burst(dev->priv, frames, num, timeout);
 }
 
 static int
@@ -193,5 +246,6 @@ struct rawdev_ops bpf_dev_ops = {
     .close = bpf_dev_close_wrap,
     .rx = bpf_dev_rx_wrap,
     .tx = bpf_dev_tx_wrap,
+    .rx_burst = bpf_dev_rx_burst_wrap,
     .addr = bpf_dev_addr_wrap
 };
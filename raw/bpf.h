@@ -3,6 +3,7 @@
 
 #include <stddef.h>
 #include <stdint.h>
+#include <sys/uio.h>
 
 struct bpf_dev;
 
@@ -15,6 +16,8 @@ bpf_dev_rx (struct bpf_dev *dev, void (*callback)(uint8_t *, size_t, void *), vo
 extern ssize_t
 bpf_dev_tx (struct bpf_dev *dev, const uint8_t *buf, size_t len);
 extern int
+bpf_dev_rx_burst (struct bpf_dev *dev, struct iovec *frames, int num, int timeout);
+extern int
 bpf_dev_addr (char *name, uint8_t *dst, size_t size);
 
 #endif
@@ -1,21 +1,160 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <errno.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
-#include <netpacket/packet.h>
+#include <linux/if_packet.h>
 #include <net/ethernet.h>
 #include <net/if.h>
 #include <arpa/inet.h>
 #include <poll.h>
+#include <pthread.h>
+#include "util.h"
 #include "soc.h"
 
+#define SOC_DEV_RX_RING_BLOCK_SIZE (1 << 18)
+#define SOC_DEV_RX_RING_BLOCK_NUM  16
+#define SOC_DEV_RX_RING_FRAME_SIZE 2048
+#define SOC_DEV_RX_RING_TIMEOUT_MS 10
+
+#define SOC_DEV_TX_RING_BLOCK_SIZE (1 << 16)
+#define SOC_DEV_TX_RING_BLOCK_NUM  8
+#define SOC_DEV_TX_RING_FRAME_SIZE 2048
+
+#define SOC_DEV_BURST_MAX 32
+#define SOC_DEV_FRAME_SIZE_MAX 2048
+
+/* offset of the frame data in a TX ring slot (see tpacket_parse_header) */
+#define SOC_DEV_TX_RING_DATA_OFFSET (TPACKET3_HDRLEN - sizeof(struct sockaddr_ll))
+
+#define SOC_DEV_RX_BLOCK(x) ((struct tpacket_block_desc *)((x)->rx.map + (size_t)(x)->rx.current * (x)->rx.block_size))
+
+struct soc_ring {
+    uint8_t *map;
+    size_t size;
+    unsigned int block_size;
+    unsigned int block_num;
+    unsigned int frame_size;
+    unsigned int frame_num;
+    unsigned int current;
+    /* RX only: block handed out by soc_dev_rx_burst() and not yet released */
+    int held;
+    uint8_t *next;
+    uint32_t left;
+};
+
 struct soc_dev {
     int fd;
+    uint8_t *map;
+    size_t size;
+    struct soc_ring rx;
+    struct soc_ring tx;
+    unsigned int pending;
+    pthread_mutex_t mutex;
+    /* recvmmsg() buffers, used when the RX ring is unavailable */
+    uint8_t buf[SOC_DEV_BURST_MAX][SOC_DEV_FRAME_SIZE_MAX];
 };
 
+/* a request for no frames releases a ring that is not mapped */
+static int
+soc_dev_release_ring (struct soc_dev *dev) {
+    struct tpacket_req3 req;
+
+    memset(&req, 0, sizeof(req));
+    if (dev->rx.size && setsockopt(dev->fd, SOL_PACKET, PACKET_RX_RING, &req, sizeof(req)) == -1) {
+        perror("setsockopt [PACKET_RX_RING]");
+        return -1;
+    }
+    if (dev->tx.size && setsockopt(dev->fd, SOL_PACKET, PACKET_TX_RING, &req, sizeof(req)) == -1) {
+        perror("setsockopt [PACKET_TX_RING]");
+        return -1;
+    }
+    memset(&dev->rx, 0, sizeof(dev->rx));
+    memset(&dev->tx, 0, sizeof(dev->tx));
+    dev->size = 0;
+    return 0;
+}
+
+/*
+ * TPACKET_V3 RX ring: the kernel fills whole blocks of frames and hands
+ * them over by setting TP_STATUS_USER, so one wakeup delivers a batch.
+ * TX ring: frames are queued in slots and the kernel sends all slots
+ * marked TP_STATUS_SEND_REQUEST on one send() call.
+ * Both rings share a single mapping (RX first, then TX). A ring that the
+ * kernel refuses falls back to read() / write(), and so do both when the
+ * mapping fails (e.g. over RLIMIT_MEMLOCK): the rings are torn down again
+ * so that the kernel goes back to the socket queue.
+ */
+static int
+soc_dev_setup_ring (struct soc_dev *dev) {
+    int version = TPACKET_V3, enable = 1;
+    struct tpacket_req3 req;
+
+    if (setsockopt(dev->fd, SOL_PACKET, PACKET_VERSION, &version, sizeof(version)) == -1) {
+        perror("setsockopt [PACKET_VERSION]");
+        return 0;
+    }
+    /* let the kernel skip malformed slots instead of stalling the ring */
+    if (setsockopt(dev->fd, SOL_PACKET, PACKET_LOSS, &enable, sizeof(enable)) == -1) {
+        perror("setsockopt [PACKET_LOSS]");
+    }
+    memset(&req, 0, sizeof(req));
+    req.tp_block_size = SOC_DEV_RX_RING_BLOCK_SIZE;
+    req.tp_block_nr = SOC_DEV_RX_RING_BLOCK_NUM;
+    req.tp_frame_size = SOC_DEV_RX_RING_FRAME_SIZE;
+    req.tp_frame_nr = (req.tp_block_size / req.tp_frame_size) * req.tp_block_nr;
+    req.tp_retire_blk_tov = SOC_DEV_RX_RING_TIMEOUT_MS;
+    if (setsockopt(dev->fd, SOL_PACKET, PACKET_RX_RING, &req, sizeof(req)) == -1) {
+        perror("setsockopt [PACKET_RX_RING]");
+    } else {
+        dev->rx.size = (size_t)req.tp_block_size * req.tp_block_nr;
+        dev->rx.block_size = req.tp_block_size;
+        dev->rx.block_num = req.tp_block_nr;
+        dev->rx.frame_size = req.tp_frame_size;
+        dev->rx.frame_num = req.tp_frame_nr;
+    }
+    memset(&req, 0, sizeof(req));
+    req.tp_block_size = SOC_DEV_TX_RING_BLOCK_SIZE;
+    req.tp_block_nr = SOC_DEV_TX_RING_BLOCK_NUM;
+    req.tp_frame_size = SOC_DEV_TX_RING_FRAME_SIZE;
+    req.tp_frame_nr = (req.tp_block_size / req.tp_frame_size) * req.tp_block_nr;
+    if (setsockopt(dev->fd, SOL_PACKET, PACKET_TX_RING, &req, sizeof(req)) == -1) {
+        perror("setsockopt [PACKET_TX_RING]");
+    } else {
+        dev->tx.size = (size_t)req.tp_block_size * req.tp_block_nr;
+        dev->tx.block_size = req.tp_block_size;
+        dev->tx.block_num = req.tp_block_nr;
+        dev->tx.frame_size = req.tp_frame_size;
+        dev->tx.frame_num = req.tp_frame_nr;
+#ifdef SOC_DEV_QDISC_BYPASS
+        if (setsockopt(dev->fd, SOL_PACKET, PACKET_QDISC_BYPASS, &enable, sizeof(enable)) == -1) {
+            perror("setsockopt [PACKET_QDISC_BYPASS]");
+        }
+#endif
+    }
+    dev->size = dev->rx.size + dev->tx.size;
+    if (!dev->size) {
+        return 0;
+    }
+    dev->map = mmap(NULL, dev->size, PROT_READ | PROT_WRITE, MAP_SHARED, dev->fd, 0);
+    if (dev->map == MAP_FAILED) {
+        perror("mmap");
+        dev->map = NULL;
+        return soc_dev_release_ring(dev);
+    }
+    if (dev->rx.size) {
+        dev->rx.map = dev->map;
+    }
+    if (dev->tx.size) {
+        dev->tx.map = dev->map + dev->rx.size;
+    }
+    return 0;
+}
+
 struct soc_dev *
 soc_dev_open (char *name) {
     struct soc_dev *dev;
@@ -27,11 +166,20 @@ soc_dev_open (char *name) {
         fprintf(stderr, "malloc: failure\n");
         goto ERROR;
     }
+    dev->map = NULL;
+    dev->size = 0;
+    memset(&dev->rx, 0, sizeof(dev->rx));
+    memset(&dev->tx, 0, sizeof(dev->tx));
+    dev->pending = 0;
+    pthread_mutex_init(&dev->mutex, NULL);
     dev->fd = socket(PF_PACKET, SOCK_RAW, htons(ETH_P_ALL));
     if (dev->fd == -1) {
         perror("socket");
         goto ERROR;
     }
+    if (soc_dev_setup_ring(dev) == -1) {
+        goto ERROR;
+    }
     strncpy(ifr.ifr_name, name, sizeof(ifr.ifr_name) - 1);
     if (ioctl(dev->fd, SIOCGIFINDEX, &ifr) == -1) {
         perror("ioctl [SIOCGIFINDEX]");
@@ -65,12 +213,124 @@ ERROR:
 
 void
 soc_dev_close (struct soc_dev *dev) {
+    if (dev->map) {
+        munmap(dev->map, dev->size);
+    }
+    pthread_mutex_destroy(&dev->mutex);
     if (dev->fd != -1) {
         close(dev->fd);
     }
     free(dev);
 }
 
+static int
+soc_dev_rx_burst_ring (struct soc_dev *dev, struct iovec *frames, int num, int timeout) {
+    struct tpacket_block_desc *block;
+    struct tpacket3_hdr *frame;
+    struct pollfd pfd;
+    int count = 0, ret;
+
+    block = SOC_DEV_RX_BLOCK(dev);
+    if (dev->rx.held && !dev->rx.left) {
+        /* the caller is done with every frame of the held block */
+        __sync_synchronize();
+        block->hdr.bh1.block_status = TP_STATUS_KERNEL;
+        dev->rx.current = (dev->rx.current + 1) % dev->rx.block_num;
+        dev->rx.held = 0;
+        block = SOC_DEV_RX_BLOCK(dev);
+    }
+    if (!dev->rx.held) {
+        if (!(block->hdr.bh1.block_status & TP_STATUS_USER)) {
+            if (!timeout) {
+                return 0;
+            }
+            pfd.fd = dev->fd;
+            pfd.events = POLLIN | POLLERR;
+            ret = poll(&pfd, 1, timeout);
+            if (ret == -1 && errno != EINTR) {
+                perror("poll");
+            }
+            if (!(block->hdr.bh1.block_status & TP_STATUS_USER)) {
+                return 0;
+            }
+        }
+        dev->rx.held = 1;
+        dev->rx.next = (uint8_t *)block + block->hdr.bh1.offset_to_first_pkt;
+        dev->rx.left = block->hdr.bh1.num_pkts;
+    }
+    while (dev->rx.left && count < num) {
+        frame = (struct tpacket3_hdr *)dev->rx.next;
+        frames[count].iov_base = (uint8_t *)frame + frame->tp_mac;
+        frames[count].iov_len = frame->tp_snaplen;
+        count++;
+        dev->rx.next += frame->tp_next_offset;
+        dev->rx.left--;
+    }
+    return count;
+}
+
+static int
+soc_dev_rx_burst_mmsg (struct soc_dev *dev, struct iovec *frames, int num, int timeout) {
+    struct mmsghdr msgs[SOC_DEV_BURST_MAX];
+    struct pollfd pfd;
+    int ret, idx;
+
+    pfd.fd = dev->fd;
+    pfd.events = POLLIN;
+    ret = poll(&pfd, 1, timeout);
+    if (ret <= 0) {
+        if (ret == -1 && errno != EINTR) {
+            perror("poll");
+        }
+        return 0;
+    }
+    num = MIN(num, SOC_DEV_BURST_MAX);
+    memset(msgs, 0, sizeof(*msgs) * num);
+    for (idx = 0; idx < num; idx++) {
+        frames[idx].iov_base = dev->buf[idx];
+        frames[idx].iov_len = sizeof(dev->buf[idx]);
+        msgs[idx].msg_hdr.msg_iov = &frames[idx];
+        msgs[idx].msg_hdr.msg_iovlen = 1;
+    }
+    ret = recvmmsg(dev->fd, msgs, num, MSG_DONTWAIT, NULL);
+    if (ret == -1) {
+        if (errno != EAGAIN && errno != EINTR) {
+            perror("recvmmsg");
+        }
+        return 0;
+    }
+    for (idx = 0; idx < ret; idx++) {
+        frames[idx].iov_len = msgs[idx].msg_len;
+    }
+    return ret;
+}
+
+/*
+ * Returns up to num frames. They stay valid until the next call, which
+ * gives the previous ones back to the kernel.
+ */
+int
+soc_dev_rx_burst (struct soc_dev *dev, struct iovec *frames, int num, int timeout) {
+    if (dev->rx.map) {
+        return soc_dev_rx_burst_ring(dev, frames, num, timeout);
+    }
+    return soc_dev_rx_burst_mmsg(dev, frames, num, timeout);
+}
+
+static void
+soc_dev_rx_ring (struct soc_dev *dev, void (*callback)(uint8_t *, size_t, void *), void *arg, int timeout) {
+    struct iovec frames[SOC_DEV_BURST_MAX];
+    int num, idx;
+
+    /* drain every block that the kernel has already retired */
+    while ((num = soc_dev_rx_burst_ring(dev, frames, SOC_DEV_BURST_MAX, timeout)) > 0) {
+        for (idx = 0; idx < num; idx++) {
+            callback(frames[idx].iov_base, frames[idx].iov_len, arg);
+        }
+        timeout = 0;
+    }
+}
+
 void
 soc_dev_rx (struct soc_dev *dev, void (*callback)(uint8_t *, size_t, void *), void *arg, int timeout) {
     struct pollfd pfd;
@@ -78,6 +338,10 @@ soc_dev_rx (struct soc_dev *dev, void (*callback)(uint8_t *, size_t, void *), vo
     ssize_t len;
     uint8_t buf[2048];
 
+    if (dev->rx.map) {
+        soc_dev_rx_ring(dev, callback, arg, timeout);
+        return;
+    }
     pfd.fd = dev->fd;
     pfd.events = POLLIN;
     ret = poll(&pfd, 1, timeout);
@@ -99,9 +363,98 @@ soc_dev_rx (struct soc_dev *dev, void (*callback)(uint8_t *, size_t, void *), vo
     callback(buf, len, arg);
 }
 
+static int
+soc_dev_tx_flush (struct soc_dev *dev) {
+    ssize_t ret;
+
+    if (!dev->pending) {
+        return 0;
+    }
+    /* one syscall sends every slot marked TP_STATUS_SEND_REQUEST */
+    ret = send(dev->fd, NULL, 0, 0);
+    if (ret == -1) {
+        perror("send");
+        return -1;
+    }
+    dev->pending = 0;
+    return 0;
+}
+
+static ssize_t
+soc_dev_tx_queue (struct soc_dev *dev, const uint8_t *buf, size_t len) {
+    struct tpacket3_hdr *hdr;
+
+    if (len > dev->tx.frame_size - SOC_DEV_TX_RING_DATA_OFFSET) {
+        return -1;
+    }
+    hdr = (struct tpacket3_hdr *)(dev->tx.map + (size_t)dev->tx.current * dev->tx.frame_size);
+    if (hdr->tp_status != TP_STATUS_AVAILABLE && hdr->tp_status != TP_STATUS_WRONG_FORMAT) {
+        /* ring is full, wait for the kernel to drain it */
+        if (soc_dev_tx_flush(dev) == -1 || (hdr->tp_status != TP_STATUS_AVAILABLE && hdr->tp_status != TP_STATUS_WRONG_FORMAT)) {
+            return -1;
+        }
+    }
+    memcpy((uint8_t *)hdr + SOC_DEV_TX_RING_DATA_OFFSET, buf, len);
+    hdr->tp_len = len;
+    hdr->tp_snaplen = len;
+    hdr->tp_next_offset = 0;
+    __sync_synchronize();
+    hdr->tp_status = TP_STATUS_SEND_REQUEST;
+    dev->tx.current = (dev->tx.current + 1) % dev->tx.frame_num;
+    dev->pending++;
+    return len;
+}
+
 ssize_t
 soc_dev_tx (struct soc_dev *dev, const uint8_t *buf, size_t len) {
-    return write(dev->fd, buf, len);
+    ssize_t ret;
+
+    if (!dev->tx.map) {
+        return write(dev->fd, buf, len);
+    }
+    pthread_mutex_lock(&dev->mutex);
+    ret = soc_dev_tx_queue(dev, buf, len);
+    if (ret != -1) {
+        soc_dev_tx_flush(dev);
+    }
+    pthread_mutex_unlock(&dev->mutex);
+    return ret;
+}
+
+int
+soc_dev_tx_burst (struct soc_dev *dev, const struct iovec *frames, int num) {
+    struct mmsghdr msgs[SOC_DEV_BURST_MAX];
+    int count, idx, ret;
+
+    if (!dev->tx.map) {
+        for (count = 0; count < num; count += ret) {
+            ret = MIN(num - count, SOC_DEV_BURST_MAX);
+            memset(msgs, 0, sizeof(*msgs) * ret);
+            for (idx = 0; idx < ret; idx++) {
+                msgs[idx].msg_hdr.msg_iov = (struct iovec *)&frames[count + idx];
+                msgs[idx].msg_hdr.msg_iovlen = 1;
+            }
+            ret = sendmmsg(dev->fd, msgs, ret, 0);
+            if (ret <= 0) {
+                perror("sendmmsg");
+                break;
+            }
+        }
+        return count;
+    }
+    pthread_mutex_lock(&dev->mutex);
+    for (count = 0; count < num; count++) {
+        if (soc_dev_tx_queue(dev, frames[count].iov_base, frames[count].iov_len) == -1) {
+            break;
+        }
+    }
+    /*
+     * The frames are in the ring whether or not the kick succeeds; a failed
+     * one is reported by soc_dev_tx_flush() and they go out with the next.
+     */
+    soc_dev_tx_flush(dev);
+    pthread_mutex_unlock(&dev->mutex);
+    return count;
 }
 
 int
@@ -145,8 +498,31 @@ soc_dev_rx_wrap (struct rawdev *dev, void (*callback)(uint8_t *, size_t, void *)
 }
 
 static ssize_t
-soc_dev_tx_wrap (struct rawdev *dev, const uint8_t *buf, size_t len) {
-    return soc_dev_tx(dev->priv, buf, len);
+soc_dev_tx_wrap (struct rawdev *dev, struct pkbuf *pkb) {
+    return soc_dev_tx(dev->priv, pkb->data, pkb->len);
+}
+
+static int
+soc_dev_rx_burst_wrap (struct rawdev *dev, struct iovec *frames, int num, int timeout) {
+    return soc_dev_rx_burst(dev->priv, frames, num, timeout);
+}
+
+static int
+soc_dev_tx_burst_wrap (struct rawdev *dev, struct pkbuf **pkbs, int num) {
+    struct iovec frames[SOC_DEV_BURST_MAX];
+    int done, idx, ret;
+
+    for (done = 0; done < num; done += ret) {
+        for (idx = 0; idx < num - done && idx < SOC_DEV_BURST_MAX; idx++) {
+            frames[idx].iov_base = pkbs[done + idx]->data;
+            frames[idx].iov_len = pkbs[done + idx]->len;
+        }
+        ret = soc_dev_tx_burst(dev->priv, frames, idx);
+        if (ret < idx) {
+            return done + ret;
+        }
+    }
+    return done;
 }
 
 static int
@@ -159,5 +535,7 @@ struct rawdev_ops soc_dev_ops = {
     .close = soc_dev_close_wrap,
     .rx = soc_dev_rx_wrap,
     .tx = soc_dev_tx_wrap,
+    .rx_burst = soc_dev_rx_burst_wrap,
+    .tx_burst = soc_dev_tx_burst_wrap,
     .addr = soc_dev_addr_wrap
 };
@@ -3,6 +3,7 @@
 
 #include <stddef.h>
 #include <stdint.h>
+#include <sys/uio.h>
 
 struct soc_dev;
 
@@ -15,6 +16,10 @@ soc_dev_rx (struct soc_dev *dev, void (*callback)(uint8_t *, size_t, void *), vo
 extern ssize_t
 soc_dev_tx (struct soc_dev *dev, const uint8_t *buf, size_t len);
 extern int
+soc_dev_rx_burst (struct soc_dev *dev, struct iovec *frames, int num, int timeout);
+extern int
+soc_dev_tx_burst (struct soc_dev *dev, const struct iovec *frames, int num);
+extern int
 soc_dev_addr (char *name, uint8_t *dst, size_t size);
 
 #endif
@@ -137,8 +137,8 @@ tap_dev_rx_wrap (struct rawdev *dev, void (*callback)(uint8_t *, size_t, void *)
 }
 
 static ssize_t
-tap_dev_tx_wrap (struct rawdev *dev, const uint8_t *buf, size_t len) {
-    return tap_dev_tx(dev->priv, buf, len);
+tap_dev_tx_wrap (struct rawdev *dev, struct pkbuf *pkb) {
+    return tap_dev_tx(dev->priv, pkb->data, pkb->len);
 }
 
 static int
@@ -136,8 +136,8 @@ tap_dev_rx_wrap (struct rawdev *dev, void (*callback)(uint8_t *, size_t, void *)
 }
 
 static ssize_t
-tap_dev_tx_wrap (struct rawdev *dev, const uint8_t *buf, size_t len) {
-    return tap_dev_tx(dev->priv, buf, len);
+tap_dev_tx_wrap (struct rawdev *dev, struct pkbuf *pkb) {
+    return tap_dev_tx(dev->priv, pkb->data, pkb->len);
 }
 
 static int
@@ -145,6 +145,10 @@ tap_dev_addr_wrap (struct rawdev *dev, uint8_t *dst, size_t size) {
     return tap_dev_addr(dev->name, dst, size);
 }
 
+/*
+ * No rx_burst/tx_burst: a tap fd moves one frame per read() or write()
+ * and cannot batch, so the per-frame path is as cheap as it gets.
+ */
 struct rawdev_ops tap_dev_ops = {
     .open = tap_dev_open_wrap,
     .close = tap_dev_close_wrap,
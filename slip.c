@@ -192,16 +192,18 @@ slip_stop (struct netdev *dev) {
 }
 
 static ssize_t
-slip_tx (struct netdev *dev, uint16_t type, const uint8_t *payload, size_t plen, const void *dst) {
+slip_tx (struct netdev *dev, uint16_t type, struct pkbuf *pkb, const void *dst) {
     struct slip_priv *priv;
     uint8_t *p;
+    size_t plen;
 
     (void)dst;
     if (type != ETHERNET_TYPE_IP) {
         return -1;
     }
     priv = (struct slip_priv *)dev->priv;
-    p = (uint8_t *)payload;
+    p = pkb->data;
+    plen = pkb->len;
     pthread_mutex_lock(&priv->mutex);
     fdputc(priv->fd, END);
     while (plen--) {
@@ -222,7 +224,7 @@ slip_tx (struct netdev *dev, uint16_t type, const uint8_t *payload, size_t plen,
     }
     fdputc(priv->fd, END);
     pthread_mutex_unlock(&priv->mutex);
-    return plen;
+    return pkb->len;
 }
 
 static struct netdev_ops slip_ops = {
@@ -5,14 +5,45 @@
 #include <stdint.h>
 #include <unistd.h>
 #include <pthread.h>
-#include <sys/time.h>
+#include <time.h>
 #include "util.h"
 #include "tcp.h"
+#include "tcp_cc.h"
 
-#define TCP_CB_TABLE_SIZE 128
+extern struct tcp_cc_ops newreno_cc_ops;
+extern struct tcp_cc_ops cubic_cc_ops;
+extern struct tcp_cc_ops bbr_cc_ops;
+
+#define TCP_SOCKET_TABLE_SIZE_MIN 128
+#define TCP_CONN_HASH_SIZE_MIN 1024 /* must be power of 2, doubled whenever the entries outnumber the buckets */
+#define TCP_PORT_HASH_SIZE 256  /* must be power of 2 */
 #define TCP_SOURCE_PORT_MIN 49152
 #define TCP_SOURCE_PORT_MAX 65535
 
+#define TCP_RCVBUF_DEFAULT 65535
+#define TCP_RCVBUF_MIN 2048
+#define TCP_RCVBUF_MAX (16 * 1024 * 1024)
+#define TCP_SNDBUF_DEFAULT 65536
+#define TCP_SNDBUF_MIN 2048
+#define TCP_SNDBUF_MAX (4 * 1024 * 1024)
+
+#define TCP_DEFAULT_MSS 536
+
+#define TCP_RANGE_ENTRY_MAX 64 /* out-of-order and SACKed ranges kept per connection */
+
+#define TCP_CLOCK_GRANULARITY 1000 /* usec, G of RFC 6298 */
+#define TCP_TIME_WAIT_TIMEOUT 60000000 /* usec, 2MSL */
+
+/* retransmission timeout (usec), see RFC 6298 */
+#define TCP_RTO_INIT 1000000
+#define TCP_RTO_MIN 200000
+#define TCP_RTO_MAX 60000000
+#define TCP_RETRANSMIT_MAX 12 /* give up after this many consecutive timeouts */
+#define TCP_SYNACK_RETRANSMIT_MAX 5 /* a half-open passive child is dropped sooner */
+
+#define TCP_TLP_DELACK_MAX 200000 /* usec, worst-case delayed ACK allowed for by the probe timeout */
+#define TCP_DELACK_TIMEOUT 40000  /* usec, how long an ACK for received data may be held back */
+
 #define TCP_CB_STATE_CLOSED      0
 #define TCP_CB_STATE_LISTEN      1
 #define TCP_CB_STATE_SYN_SENT    2
@@ -35,6 +66,60 @@
 #define TCP_FLG_IS(x, y) ((x & 0x3f) == (y))
 #define TCP_FLG_ISSET(x, y) ((x & 0x3f) & (y))
 
+#define TCP_OPTION_EOL 0
+#define TCP_OPTION_NOP 1
+#define TCP_OPTION_MSS 2
+#define TCP_OPTION_WSCALE 3
+#define TCP_OPTION_SACK_PERMITTED 4
+#define TCP_OPTION_SACK 5
+#define TCP_OPTION_TIMESTAMP 8
+
+#define TCP_OPTION_MSS_LEN 4
+#define TCP_OPTION_WSCALE_LEN 3
+#define TCP_OPTION_SACK_PERMITTED_LEN 2
+#define TCP_OPTION_TIMESTAMP_LEN 10
+#define TCP_OPTION_TIMESTAMP_SPACE 12 /* with two NOPs for alignment, taken from every segment's MSS */
+
+#define TCP_SACK_BLOCKS_MAX 4
+
+#define TCP_WSCALE_MAX 14 /* RFC 7323 2.3 */
+
+#define TCP_PAWS_IDLE (24ULL * 24 * 3600 * 1000000) /* usec, TS.Recent is stale after this (RFC 7323 5.5) */
+
+#define TCP_HDR_OPTIONS_SIZE_MAX 40
+
+/* sequence number comparison (modulo 2^32) */
+#define TCP_SEQ_LT(x, y)  ((int32_t)((x) - (y)) < 0)
+#define TCP_SEQ_LEQ(x, y) ((int32_t)((x) - (y)) <= 0)
+#define TCP_SEQ_GT(x, y)  ((int32_t)((x) - (y)) > 0)
+#define TCP_SEQ_GEQ(x, y) ((int32_t)((x) - (y)) >= 0)
+
+#define TCP_CB_FLG_FIN_PENDING 0x01 /* FIN goes out after the queued data */
+#define TCP_CB_FLG_FIN_SENT    0x02
+#define TCP_CB_FLG_RECOVERY    0x04 /* in fast recovery */
+#define TCP_CB_FLG_SACK_OK     0x08 /* SACK-permitted was exchanged */
+#define TCP_CB_FLG_RACK        0x10 /* RACK-TLP loss detection, used once SACK is agreed */
+#define TCP_CB_FLG_NODELAY     0x20 /* no Nagle coalescing */
+#define TCP_CB_FLG_CORK        0x40 /* hold partial segments */
+#define TCP_CB_FLG_WSCALE      0x80 /* window scale options were exchanged */
+#define TCP_CB_FLG_TIMESTAMP   0x100 /* timestamps options were exchanged */
+#define TCP_CB_FLG_SYNCOOKIES  0x200 /* a listener answers with SYN cookies once its half-open queue is full */
+#define TCP_CB_FLG_SYNQ        0x400 /* a passive child counted in its listener's half-open queue */
+
+/*
+ * SYN cookie (the ISS of a SYN/ACK sent without keeping state)
+ *   bits 31-27: counter, advanced every TCP_SYNCOOKIE_PERIOD seconds
+ *   bits 26-24: index of the peer's MSS in tcp_syncookie_mss[]
+ *   bits 23-0 : SipHash-2-4 of the 4-tuple, the peer's ISN, the counter
+ *               and the MSS index, under a key chosen at startup
+ * When the peer sends timestamps, the low bits of our TSval carry the
+ * options the cookie has no room for, and come back in its TSecr.
+ */
+#define TCP_SYNCOOKIE_PERIOD 64 /* sec, a cookie is accepted for one to two periods */
+#define TCP_SYNCOOKIE_TS_MASK 0x3f
+#define TCP_SYNCOOKIE_TS_SACK 0x10
+#define TCP_SYNCOOKIE_TS_NOWS 0x0f /* the window scale nibble when the peer sent none */
+
 struct tcp_hdr {
     uint16_t src;
     uint16_t dst;
@@ -47,21 +132,76 @@ struct tcp_hdr {
     uint16_t urg;
 };
 
+struct tcp_options {
+    uint16_t mss;
+    int wscale; /* -1 if absent */
+    uint8_t sack_ok;
+    uint8_t ts_ok; /* a timestamps option is present */
+    uint32_t tsval;
+    uint32_t tsecr;
+    int nsack;
+    struct {
+        uint32_t seq;
+        uint32_t end;
+    } sack[TCP_SACK_BLOCKS_MAX];
+};
+
+/*
+ * Byte ring used as the send and receive buffers. The storage is
+ * allocated on the first write and released when the ring becomes empty.
+ * Data may be stored ahead of the tail (out-of-order segments) and is
+ * committed once everything in front of it has arrived.
+ */
+struct tcp_ring {
+    uint8_t *buf;
+    size_t size;
+    size_t head;
+    size_t len;
+    size_t ahead; /* extent of data stored past len */
+};
+
+/*
+ * A contiguous range of sequence space: out-of-order data stored in the
+ * receive ring, or data the peer has selectively acknowledged.
+ */
+struct tcp_range {
+    uint32_t seq;
+    uint32_t end;
+    uint8_t fin;
+    struct tcp_range *next;
+};
+
+#define TCP_TXQ_FLG_RETRANSMITTED 0x01
+#define TCP_TXQ_FLG_SACKED        0x02
+#define TCP_TXQ_FLG_LOST          0x04 /* marked lost by RACK, cleared when resent */
+
+/*
+ * A range of sequence space that has been sent and not yet acknowledged.
+ * The data stays in the send buffer (sndbuf), so a retransmission is
+ * rebuilt from there.
+ */
 struct tcp_txq_entry {
-    struct tcp_hdr *segment;
-    uint16_t len;
-    struct timeval timestamp;
+    uint32_t seq;
+    uint32_t end; /* seq + payload length (+1 for SYN and FIN) */
+    uint8_t flags;
+    uint64_t timestamp; /* usec, last (re)transmission */
+    uint64_t delivered; /* the connection's delivery state when sent */
+    uint64_t delivered_stamp;
     struct tcp_txq_entry *next;
 };
 
 struct tcp_txq_head {
     struct tcp_txq_entry *head;
     struct tcp_txq_entry *tail;
+    struct tcp_txq_entry *free; /* acknowledged entries kept for reuse */
 };
 
 struct tcp_cb {
-    uint8_t used;
+    int ref;
+    pthread_mutex_t mutex;
+    int desc; /* socket descriptor (-1 until accepted) */
     uint8_t state;
+    uint16_t flags;
     struct netif *iface;
     uint16_t port;
     struct {
@@ -71,163 +211,2601 @@ struct tcp_cb {
     struct {
         uint32_t nxt;
         uint32_t una;
+        uint32_t max; /* highest sequence number sent, snd.nxt is rewound on timeout */
         uint16_t up;
         uint32_t wl1;
         uint32_t wl2;
-        uint16_t wnd;
+        uint32_t wnd;
+        uint8_t wscale; /* shift applied to the peer's window field */
     } snd;
     uint32_t iss;
     struct {
         uint32_t nxt;
         uint16_t up;
-        uint16_t wnd;
+        uint32_t wnd;
+        uint8_t wscale; /* shift applied to the window we advertise */
+        uint32_t adv;   /* right edge of the window last advertised */
     } rcv;
     uint32_t irs;
+    struct {
+        uint32_t offset;        /* added to our clock, random per connection (RFC 7323 7.1) */
+        uint32_t recent;        /* TS.Recent, the peer's timestamp to echo */
+        uint64_t recent_stamp;  /* usec, when TS.Recent was taken, 0 if never */
+        uint32_t last_ack_sent; /* Last.ACK.sent */
+    } ts;
+    uint16_t mss; /* maximum segment size for sending, less the options on every segment */
+    uint32_t srtt;   /* usec, 0 until the first RTT sample */
+    uint32_t rttvar;
+    uint32_t rto;         /* not including the backoff */
+    uint8_t retransmits;  /* consecutive timeouts, the exponent of the backoff */
+    uint64_t rtx_expire;  /* retransmission timer, 0 while stopped */
+    struct {
+        uint64_t expire; /* persist timer, 0 while stopped */
+        uint8_t probes;  /* sent since the window closed, the exponent of the backoff */
+    } persist;
+    uint32_t dupacks;     /* duplicate ACKs since snd.una last moved, less those a partial ACK covered */
+    uint32_t recover;     /* snd.max when fast recovery started, see RFC 6582 */
+    struct tcp_cc cc;
+    uint64_t delivered;       /* bytes acknowledged, for delivery rate samples */
+    uint64_t delivered_stamp; /* usec, when delivered last changed */
+    uint64_t pacing_stamp;    /* usec */
+    uint64_t pacing_credit;   /* bytes that may be sent now at the pacing rate */
+    struct tcp_ring sndbuf; /* from snd.una to the end of queued data */
     struct tcp_txq_head txq;
-    uint8_t window[65535];
+    struct tcp_ring rcvbuf; /* received data not yet read, up to rcv.nxt */
+    struct {
+        uint32_t bytes;  /* received since the last ACK was sent */
+        uint64_t expire; /* delayed ACK timer, 0 while stopped */
+    } delack;
+    struct tcp_range *ooo; /* sorted by sequence number */
+    int nooo;
+    uint32_t ooo_recent; /* start of the latest out-of-order segment, reported first */
+    struct tcp_range *sack; /* SACK scoreboard above snd.una, sorted */
+    int nsack;
+    uint32_t sacked;    /* bytes in the scoreboard */
+    uint32_t sack_high; /* end of the highest SACKed range, snd.una if none */
+    uint32_t rtx_next;  /* where retransmission resumes in SACK recovery */
+    struct {
+        uint64_t xmit_ts; /* usec, send time of the most recently sent segment delivered */
+        uint32_t end_seq; /* and its end, to order segments sent at the same time */
+        uint32_t rtt;     /* usec, RTT of that segment */
+        uint32_t min_rtt;
+        uint64_t expire;  /* reordering timer, 0 while stopped */
+    } rack;
+    struct {
+        uint64_t expire; /* probe timeout, 0 while stopped */
+        uint8_t sent;    /* a probe is outstanding */
+        uint8_t retrans; /* the probe resent data already sent */
+        uint32_t end;    /* snd.max when the probe was sent */
+    } tlp;
+    uint64_t tw_expire; /* TIME_WAIT timer of a TCB kept for want of a tcp_tw entry, 0 while stopped */
+    struct {
+        uint64_t expire; /* when the timer thread looks at the TCB next */
+        ssize_t index;   /* position in timer_heap, -1 if not queued */
+    } timer;
     struct tcp_cb *parent;
-    struct queue_head backlog;
+    struct queue_head backlog;  /* established children waiting for tcp_api_accept() */
+    struct queue_head overflow; /* established children waiting for room in the backlog */
+    int backlog_max;            /* bounds the backlog */
+    int synq_max;               /* bounds the half-open children and the overflow together */
+    int nsynq;                  /* half-open children (SYN_RCVD) */
     pthread_cond_t cond;
+    struct tcp_cb *hnext; /* 4-tuple hash chain */
+    struct tcp_cb *pnext; /* port hash chain */
+    struct tcp_cb *prev;  /* list of all TCBs */
+    struct tcp_cb *next;
 };
 
-#define TCP_CB_LISTENER_SIZE 128
+/*
+ * A connection in TIME_WAIT. The TCB is freed on entering the state and
+ * only what is needed to acknowledge a retransmitted FIN, and to keep
+ * the 4-tuple from being reused too early, is kept until 2MSL pass.
+ */
+struct tcp_tw {
+    struct netif *iface;
+    ip_addr_t addr;  /* peer */
+    uint16_t port;   /* peer */
+    uint16_t lport;
+    uint32_t snd_nxt;
+    uint32_t rcv_nxt;
+    uint16_t win;    /* the window field of our ACKs (network byte order) */
+    uint8_t ts;      /* timestamps were exchanged */
+    uint32_t ts_offset;
+    uint32_t ts_recent;
+    uint64_t expire; /* usec */
+    struct tcp_tw *hnext; /* 4-tuple hash chain */
+    struct tcp_tw *prev;  /* list in order of expiry */
+    struct tcp_tw *next;
+};
+
+struct tcp_socket {
+    struct tcp_cb *cb;
+    int next; /* next free descriptor */
+};
+
+#define TCP_BACKLOG_DEFAULT 128 /* when tcp_api_listen() is given none */
+#define TCP_SYNQ_DEFAULT 256
 
 #define TCP_CB_STATE_RX_ISREADY(x) (x->state == TCP_CB_STATE_ESTABLISHED || x->state == TCP_CB_STATE_FIN_WAIT1 || x->state == TCP_CB_STATE_FIN_WAIT2)
 #define TCP_CB_STATE_TX_ISREADY(x) (x->state == TCP_CB_STATE_ESTABLISHED || x->state == TCP_CB_STATE_CLOSE_WAIT)
-
-#define TCP_SOCKET_ISINVALID(x) (x < 0 || x >= TCP_CB_TABLE_SIZE)
+#define TCP_CB_STATE_SND_ISREADY(x) (TCP_CB_STATE_TX_ISREADY(x) || x->state == TCP_CB_STATE_FIN_WAIT1 || x->state == TCP_CB_STATE_CLOSING || x->state == TCP_CB_STATE_LAST_ACK)
 
 static pthread_t timer_thread;
-struct tcp_cb cb_table[TCP_CB_TABLE_SIZE];
-pthread_mutex_t mutex;
+
+/*
+ * Locking
+ *   table_lock protects the socket table, the lookup tables and the list
+ *   of all TCBs. Every other field of a TCB is protected by its own mutex.
+ *   table_lock may be taken while holding a TCB mutex but never the other
+ *   way around, and a child TCB is locked before its listener.
+ *   A reference is held on a TCB while it is used outside table_lock; the
+ *   tables own one reference, dropped when the socket is closed.
+ *   TIME_WAIT entries are protected by table_lock.
+ *   timer_lock protects the timer heap and tw_expire and is taken after
+ *   any other lock.
+ */
+static pthread_rwlock_t table_lock = PTHREAD_RWLOCK_INITIALIZER;
+static pthread_mutex_t timer_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t timer_cond;
+
+/*
+ * Socket descriptors index this table, which grows on demand. TCBs are
+ * allocated when a socket is opened or a SYN arrives at a listener, and
+ * a passive child gets its descriptor only when it is accepted.
+ */
+static struct tcp_socket *sockets;
+static int sockets_size;
+static int sockets_free = -1;
+static struct tcp_cb *cb_list;
+
+/*
+ * Every TCB with a timer running is queued in this binary min-heap,
+ * keyed by timer.expire, and holds a reference while it is. The key is
+ * only ever lowered in place, so it may be earlier than the TCB's next
+ * deadline but never later; the timer thread sleeps until the root's.
+ */
+static struct tcp_cb **timer_heap;
+static size_t timer_heap_num;
+static size_t timer_heap_size;
+
+/*
+ * Connection lookup tables
+ *   conn_hash: every TCB that has a peer, keyed by the 4-tuple
+ *   port_hash: every TCB that owns its local port (bound, listening or
+ *              actively opened), keyed by the port. Passive children
+ *              share the listener's port and are not registered here.
+ */
+static struct tcp_cb **conn_hash;
+static size_t conn_hash_size;
+static size_t conn_hash_num;
+
+/*
+ * TIME_WAIT entries, keyed by the 4-tuple like conn_hash. Every entry
+ * waits for the same time, so appending keeps the list sorted by expiry.
+ */
+static struct tcp_tw **tw_hash;
+static size_t tw_hash_size;
+static size_t tw_hash_num;
+static struct tcp_tw *tw_head;
+static struct tcp_tw *tw_tail;
+static uint64_t tw_expire; /* of tw_head, 0 if none, for the timer thread */
+static struct tcp_cb *port_hash[TCP_PORT_HASH_SIZE];
+static uint32_t hash_seed;
+static uint64_t syncookie_key[2];
+static uint32_t syncookie_tsoff; /* hides our uptime in cookie TSvals */
+
+static const uint16_t tcp_syncookie_mss[] = {536, 1024, 1220, 1300, 1380, 1440, 1452, 1460};
+
+static uint32_t
+tcp_hash (ip_addr_t addr, uint16_t port, uint16_t lport) {
+    uint32_t h;
+
+    h = (addr ^ hash_seed) + (((uint32_t)port << 16) | lport);
+    h ^= h >> 16;
+    h *= 0x7feb352d;
+    h ^= h >> 15;
+    h *= 0x846ca68b;
+    h ^= h >> 16;
+    return h;
+}
+
+#define TCP_CONN_HASH(x, y, z) (&conn_hash[tcp_hash((x), (y), (z)) & (conn_hash_size - 1)])
+#define TCP_PORT_HASH(x) (&port_hash[(ntoh16(x) ^ (ntoh16(x) >> 8)) & (TCP_PORT_HASH_SIZE - 1)])
+
+/*
+ * Double the buckets, keeping the average chain under one entry so that
+ * lookups stay constant-time. If memory is short the chains just grow.
+ */
+static void
+tcp_conn_hash_grow (void) {
+    struct tcp_cb **tmp, **head, *cb, *next;
+    size_t size, idx;
+
+    size = conn_hash_size * 2;
+    tmp = calloc(size, sizeof(*tmp));
+    if (!tmp) {
+        return;
+    }
+    for (idx = 0; idx < conn_hash_size; idx++) {
+        for (cb = conn_hash[idx]; cb; cb = next) {
+            next = cb->hnext;
+            head = &tmp[tcp_hash(cb->peer.addr, cb->peer.port, cb->port) & (size - 1)];
+            cb->hnext = *head;
+            *head = cb;
+        }
+    }
+    free(conn_hash);
+    conn_hash = tmp;
+    conn_hash_size = size;
+}
+
+static void
+tcp_conn_hash_add (struct tcp_cb *cb) {
+    struct tcp_cb **head;
+
+    if (++conn_hash_num > conn_hash_size) {
+        tcp_conn_hash_grow();
+    }
+    head = TCP_CONN_HASH(cb->peer.addr, cb->peer.port, cb->port);
+    cb->hnext = *head;
+    *head = cb;
+}
+
+static void
+tcp_conn_hash_del (struct tcp_cb *cb) {
+    struct tcp_cb **entry;
+
+    for (entry = TCP_CONN_HASH(cb->peer.addr, cb->peer.port, cb->port); *entry; entry = &(*entry)->hnext) {
+        if (*entry == cb) {
+            *entry = cb->hnext;
+            cb->hnext = NULL;
+            conn_hash_num--;
+            return;
+        }
+    }
+}
+
+static struct tcp_cb *
+tcp_conn_lookup (struct netif *iface, ip_addr_t addr, uint16_t port, uint16_t lport) {
+    struct tcp_cb *cb;
+
+    for (cb = *TCP_CONN_HASH(addr, port, lport); cb; cb = cb->hnext) {
+        if (cb->peer.addr == addr && cb->peer.port == port && cb->port == lport && (!cb->iface || cb->iface == iface)) {
+            return cb;
+        }
+    }
+    return NULL;
+}
+
+#define TCP_TW_HASH(x, y, z) (&tw_hash[tcp_hash((x), (y), (z)) & (tw_hash_size - 1)])
+
+static struct tcp_tw *
+tcp_tw_lookup (struct netif *iface, ip_addr_t addr, uint16_t port, uint16_t lport) {
+    struct tcp_tw *tw;
+
+    for (tw = *TCP_TW_HASH(addr, port, lport); tw; tw = tw->hnext) {
+        if (tw->addr == addr && tw->port == port && tw->lport == lport && tw->iface == iface) {
+            return tw;
+        }
+    }
+    return NULL;
+}
+
+/* tell the timer thread when the oldest entry expires */
+static void
+tcp_tw_update (void) {
+    pthread_mutex_lock(&timer_lock);
+    if ((tw_head ? tw_head->expire : 0) != tw_expire) {
+        tw_expire = tw_head ? tw_head->expire : 0;
+        pthread_cond_signal(&timer_cond);
+    }
+    pthread_mutex_unlock(&timer_lock);
+}
+
+/* NOTE: must be called with table_lock held for writing */
+static void
+tcp_tw_append (struct tcp_tw *tw) {
+    tw->next = NULL;
+    tw->prev = tw_tail;
+    if (tw_tail) {
+        tw_tail->next = tw;
+    } else {
+        tw_head = tw;
+    }
+    tw_tail = tw;
+}
+
+/* NOTE: must be called with table_lock held for writing */
+static void
+tcp_tw_unlink (struct tcp_tw *tw) {
+    if (tw->prev) {
+        tw->prev->next = tw->next;
+    } else {
+        tw_head = tw->next;
+    }
+    if (tw->next) {
+        tw->next->prev = tw->prev;
+    } else {
+        tw_tail = tw->prev;
+    }
+}
+
+/* like tcp_conn_hash_grow() */
+static void
+tcp_tw_hash_grow (void) {
+    struct tcp_tw **tmp, **head, *tw, *next;
+    size_t size, idx;
+
+    size = tw_hash_size * 2;
+    tmp = calloc(size, sizeof(*tmp));
+    if (!tmp) {
+        return;
+    }
+    for (idx = 0; idx < tw_hash_size; idx++) {
+        for (tw = tw_hash[idx]; tw; tw = next) {
+            next = tw->hnext;
+            head = &tmp[tcp_hash(tw->addr, tw->port, tw->lport) & (size - 1)];
+            tw->hnext = *head;
+            *head = tw;
+        }
+    }
+    free(tw_hash);
+    tw_hash = tmp;
+    tw_hash_size = size;
+}
+
+/* NOTE: must be called with table_lock held for writing */
+static void
+tcp_tw_add (struct tcp_tw *tw) {
+    struct tcp_tw **head;
+
+    if (++tw_hash_num > tw_hash_size) {
+        tcp_tw_hash_grow();
+    }
+    head = TCP_TW_HASH(tw->addr, tw->port, tw->lport);
+    tw->hnext = *head;
+    *head = tw;
+    tcp_tw_append(tw);
+    if (tw_head == tw) {
+        tcp_tw_update();
+    }
+}
+
+/* NOTE: must be called with table_lock held for writing */
+static void
+tcp_tw_del (struct tcp_tw *tw) {
+    struct tcp_tw **entry;
+    int head;
+
+    for (entry = TCP_TW_HASH(tw->addr, tw->port, tw->lport); *entry; entry = &(*entry)->hnext) {
+        if (*entry == tw) {
+            *entry = tw->hnext;
+            tw_hash_num--;
+            break;
+        }
+    }
+    head = tw == tw_head;
+    tcp_tw_unlink(tw);
+    free(tw);
+    if (head) {
+        tcp_tw_update();
+    }
+}
+
+/* 2MSL have passed for the oldest entries */
+static void
+tcp_tw_reap (uint64_t now) {
+    pthread_rwlock_wrlock(&table_lock);
+    while (tw_head && tw_head->expire <= now) {
+        tcp_tw_del(tw_head);
+    }
+    pthread_rwlock_unlock(&table_lock);
+}
+
+static void
+tcp_port_hash_add (struct tcp_cb *cb) {
+    struct tcp_cb **head;
+
+    head = TCP_PORT_HASH(cb->port);
+    cb->pnext = *head;
+    *head = cb;
+}
+
+static void
+tcp_port_hash_del (struct tcp_cb *cb) {
+    struct tcp_cb **entry;
+
+    for (entry = TCP_PORT_HASH(cb->port); *entry; entry = &(*entry)->pnext) {
+        if (*entry == cb) {
+            *entry = cb->pnext;
+            cb->pnext = NULL;
+            return;
+        }
+    }
+}
+
+static struct tcp_cb *
+tcp_port_lookup (uint16_t port) {
+    struct tcp_cb *cb;
+
+    for (cb = *TCP_PORT_HASH(port); cb; cb = cb->pnext) {
+        if (cb->port == port) {
+            return cb;
+        }
+    }
+    return NULL;
+}
+
+static struct tcp_cb *
+tcp_listener_lookup (struct netif *iface, uint16_t port) {
+    struct tcp_cb *cb;
+
+    for (cb = *TCP_PORT_HASH(port); cb; cb = cb->pnext) {
+        if (cb->port == port && cb->state == TCP_CB_STATE_LISTEN && (!cb->iface || cb->iface == iface)) {
+            return cb;
+        }
+    }
+    return NULL;
+}
 
 static int
-tcp_txq_add (struct tcp_cb *cb, struct tcp_hdr *hdr, size_t len) {
+tcp_socket_alloc (struct tcp_cb *cb) {
+    struct tcp_socket *tmp;
+    int size, soc;
+
+    if (sockets_free == -1) {
+        size = sockets_size ? sockets_size * 2 : TCP_SOCKET_TABLE_SIZE_MIN;
+        tmp = realloc(sockets, sizeof(struct tcp_socket) * size);
+        if (!tmp) {
+            return -1;
+        }
+        sockets = tmp;
+        for (soc = size - 1; soc >= sockets_size; soc--) {
+            sockets[soc].cb = NULL;
+            sockets[soc].next = sockets_free;
+            sockets_free = soc;
+        }
+        sockets_size = size;
+    }
+    soc = sockets_free;
+    sockets_free = sockets[soc].next;
+    sockets[soc].cb = cb;
+    cb->desc = soc;
+    return soc;
+}
+
+static void
+tcp_socket_free (int soc) {
+    sockets[soc].cb = NULL;
+    sockets[soc].next = sockets_free;
+    sockets_free = soc;
+}
+
+static struct tcp_cb *
+tcp_socket_lookup (int soc) {
+    if (soc < 0 || soc >= sockets_size) {
+        return NULL;
+    }
+    return sockets[soc].cb;
+}
+
+static struct tcp_cb *
+tcp_cb_alloc (void) {
+    struct tcp_cb *cb;
+
+    cb = calloc(1, sizeof(struct tcp_cb));
+    if (!cb) {
+        return NULL;
+    }
+    cb->ref = 1;
+    pthread_mutex_init(&cb->mutex, NULL);
+    cb->desc = -1;
+    cb->state = TCP_CB_STATE_CLOSED;
+    cb->rcvbuf.size = TCP_RCVBUF_DEFAULT;
+    cb->sndbuf.size = TCP_SNDBUF_DEFAULT;
+    cb->rto = TCP_RTO_INIT;
+    cb->cc.ops = &newreno_cc_ops;
+    cb->flags = TCP_CB_FLG_RACK | TCP_CB_FLG_SYNCOOKIES;
+    cb->synq_max = TCP_SYNQ_DEFAULT;
+    cb->timer.index = -1;
+    pthread_cond_init(&cb->cond, NULL);
+    cb->next = cb_list;
+    if (cb_list) {
+        cb_list->prev = cb;
+    }
+    cb_list = cb;
+    return cb;
+}
+
+static struct tcp_cb *
+tcp_cb_get (struct tcp_cb *cb) {
+    __sync_add_and_fetch(&cb->ref, 1);
+    return cb;
+}
+
+static void
+tcp_range_clear (struct tcp_range **list, int *num) {
+    struct tcp_range *range;
+
+    while ((range = *list)) {
+        *list = range->next;
+        free(range);
+    }
+    *num = 0;
+}
+
+/* free the buffers and queues, which a TCB no longer needs from TIME_WAIT on */
+static void
+tcp_cb_release (struct tcp_cb *cb) {
     struct tcp_txq_entry *txq;
 
-    txq = malloc(sizeof(struct tcp_txq_entry));
-    if (!txq) {
-        return -1;
+    while (cb->txq.head) {
+        txq = cb->txq.head;
+        cb->txq.head = txq->next;
+        free(txq);
+    }
+    cb->txq.tail = NULL;
+    while (cb->txq.free) {
+        txq = cb->txq.free;
+        cb->txq.free = txq->next;
+        free(txq);
+    }
+    tcp_range_clear(&cb->ooo, &cb->nooo);
+    tcp_range_clear(&cb->sack, &cb->nsack);
+    free(cb->rcvbuf.buf);
+    memset(&cb->rcvbuf, 0, sizeof(cb->rcvbuf));
+    free(cb->sndbuf.buf);
+    memset(&cb->sndbuf, 0, sizeof(cb->sndbuf));
+}
+
+static void
+tcp_cb_put (struct tcp_cb *cb) {
+    if (__sync_sub_and_fetch(&cb->ref, 1) != 0) {
+        return;
+    }
+    tcp_cb_release(cb);
+    if (cb->parent) {
+        tcp_cb_put(cb->parent);
+    }
+    pthread_cond_destroy(&cb->cond);
+    pthread_mutex_destroy(&cb->mutex);
+    free(cb);
+}
+
+static void
+tcp_timer_heap_set (size_t index, struct tcp_cb *cb) {
+    timer_heap[index] = cb;
+    cb->timer.index = index;
+}
+
+static void
+tcp_timer_heap_up (size_t index) {
+    struct tcp_cb *cb;
+    size_t parent;
+
+    cb = timer_heap[index];
+    while (index) {
+        parent = (index - 1) / 2;
+        if (timer_heap[parent]->timer.expire <= cb->timer.expire) {
+            break;
+        }
+        tcp_timer_heap_set(index, timer_heap[parent]);
+        index = parent;
+    }
+    tcp_timer_heap_set(index, cb);
+}
+
+static void
+tcp_timer_heap_down (size_t index) {
+    struct tcp_cb *cb;
+    size_t child;
+
+    cb = timer_heap[index];
+    while ((child = 2 * index + 1) < timer_heap_num) {
+        if (child + 1 < timer_heap_num && timer_heap[child + 1]->timer.expire < timer_heap[child]->timer.expire) {
+            child++;
+        }
+        if (cb->timer.expire <= timer_heap[child]->timer.expire) {
+            break;
+        }
+        tcp_timer_heap_set(index, timer_heap[child]);
+        index = child;
+    }
+    tcp_timer_heap_set(index, cb);
+}
+
+/* NOTE: must be called with timer_lock held, the caller takes over the heap's reference */
+static void
+tcp_timer_heap_del (struct tcp_cb *cb) {
+    struct tcp_cb *last;
+    size_t index;
+
+    index = cb->timer.index;
+    cb->timer.index = -1;
+    last = timer_heap[--timer_heap_num];
+    if (last != cb) {
+        tcp_timer_heap_set(index, last);
+        tcp_timer_heap_down(index);
+        tcp_timer_heap_up(last->timer.index);
+    }
+}
+
+/* have the timer thread look at the TCB by expire (usec, 0 does nothing) */
+static int
+tcp_timer_arm (struct tcp_cb *cb, uint64_t expire) {
+    struct tcp_cb **tmp;
+    size_t size;
+
+    if (!expire) {
+        return 0;
+    }
+    pthread_mutex_lock(&timer_lock);
+    if (cb->timer.index != -1) {
+        if (expire < cb->timer.expire) {
+            cb->timer.expire = expire;
+            tcp_timer_heap_up(cb->timer.index);
+        }
+    } else {
+        if (timer_heap_num == timer_heap_size) {
+            size = timer_heap_size ? timer_heap_size * 2 : 128;
+            tmp = realloc(timer_heap, sizeof(*tmp) * size);
+            if (!tmp) {
+                pthread_mutex_unlock(&timer_lock);
+                return -1;
+            }
+            timer_heap = tmp;
+            timer_heap_size = size;
+        }
+        cb->timer.expire = expire;
+        tcp_timer_heap_set(timer_heap_num++, tcp_cb_get(cb));
+        tcp_timer_heap_up(cb->timer.index);
+    }
+    if (!cb->timer.index) {
+        /* a new earliest deadline */
+        pthread_cond_signal(&timer_cond);
+    }
+    pthread_mutex_unlock(&timer_lock);
+    return 0;
+}
+
+static void
+tcp_timer_cancel (struct tcp_cb *cb) {
+    pthread_mutex_lock(&timer_lock);
+    if (cb->timer.index == -1) {
+        pthread_mutex_unlock(&timer_lock);
+        return;
+    }
+    tcp_timer_heap_del(cb);
+    pthread_mutex_unlock(&timer_lock);
+    tcp_cb_put(cb);
+}
+
+/* the earlier of two deadlines, where 0 is a stopped timer */
+static uint64_t
+tcp_timer_min (uint64_t a, uint64_t b) {
+    if (!a || !b) {
+        return a ? a : b;
+    }
+    return MIN(a, b);
+}
+
+/* the earliest of the TCB's timers, 0 if none is running */
+static uint64_t
+tcp_timer_next (struct tcp_cb *cb) {
+    uint64_t next;
+
+    next = tcp_timer_min(cb->rtx_expire, cb->delack.expire);
+    next = tcp_timer_min(next, cb->persist.expire);
+    next = tcp_timer_min(next, cb->rack.expire);
+    next = tcp_timer_min(next, cb->tlp.expire);
+    return tcp_timer_min(next, cb->tw_expire);
+}
+
+/* NOTE: must be called with table_lock held for writing */
+static void
+tcp_cb_unlink (struct tcp_cb *cb) {
+    tcp_timer_cancel(cb);
+    if (cb->peer.port) {
+        tcp_conn_hash_del(cb);
+    }
+    tcp_port_hash_del(cb);
+    if (cb->desc != -1) {
+        tcp_socket_free(cb->desc);
+        cb->desc = -1;
+    }
+    if (cb->prev) {
+        cb->prev->next = cb->next;
+    } else {
+        cb_list = cb->next;
+    }
+    if (cb->next) {
+        cb->next->prev = cb->prev;
+    }
+}
+
+/* returns the TCB locked and referenced, release it with tcp_socket_put() */
+static struct tcp_cb *
+tcp_socket_get (int soc) {
+    struct tcp_cb *cb;
+
+    pthread_rwlock_rdlock(&table_lock);
+    cb = tcp_socket_lookup(soc);
+    if (cb) {
+        tcp_cb_get(cb);
+    }
+    pthread_rwlock_unlock(&table_lock);
+    if (cb) {
+        pthread_mutex_lock(&cb->mutex);
+    }
+    return cb;
+}
+
+static void
+tcp_socket_put (struct tcp_cb *cb) {
+    pthread_mutex_unlock(&cb->mutex);
+    tcp_cb_put(cb);
+}
+
+/* store data at offset bytes past the tail without committing it */
+static size_t
+tcp_ring_store (struct tcp_ring *ring, size_t offset, const uint8_t *data, size_t len) {
+    size_t pos, n;
+
+    if (ring->len + offset >= ring->size) {
+        return 0;
+    }
+    if (!ring->buf) {
+        ring->buf = malloc(ring->size);
+        if (!ring->buf) {
+            return 0;
+        }
+        ring->head = 0;
+    }
+    len = MIN(len, ring->size - (ring->len + offset));
+    pos = (ring->head + ring->len + offset) % ring->size;
+    n = MIN(len, ring->size - pos);
+    memcpy(ring->buf + pos, data, n);
+    memcpy(ring->buf, data + n, len - n);
+    ring->ahead = MAX(ring->ahead, offset + len);
+    return len;
+}
+
+static void
+tcp_ring_commit (struct tcp_ring *ring, size_t len) {
+    ring->len += len;
+    ring->ahead = ring->ahead > len ? ring->ahead - len : 0;
+}
+
+static size_t
+tcp_ring_write (struct tcp_ring *ring, const uint8_t *data, size_t len) {
+    len = tcp_ring_store(ring, 0, data, len);
+    tcp_ring_commit(ring, len);
+    return len;
+}
+
+static void
+tcp_ring_read (struct tcp_ring *ring, size_t offset, uint8_t *dst, size_t len) {
+    size_t pos, n;
+
+    pos = (ring->head + offset) % ring->size;
+    n = MIN(len, ring->size - pos);
+    memcpy(dst, ring->buf + pos, n);
+    memcpy(dst + n, ring->buf, len - n);
+}
+
+static void
+tcp_ring_consume (struct tcp_ring *ring, size_t len) {
+    ring->head = (ring->head + len) % ring->size;
+    ring->len -= len;
+    if (!ring->len && !ring->ahead) {
+        free(ring->buf);
+        ring->buf = NULL;
+    }
+}
+
+static struct tcp_cc_ops *
+tcp_cc_ops_lookup (int type) {
+    switch (type) {
+        case TCP_CC_NEWRENO:
+            return &newreno_cc_ops;
+        case TCP_CC_CUBIC:
+            return &cubic_cc_ops;
+        case TCP_CC_BBR:
+            return &bbr_cc_ops;
+        default:
+            return NULL;
+    }
+}
+
+static uint64_t
+tcp_clock (void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* record seglen (> 0) octets of sequence space from seq as sent */
+static int
+tcp_txq_add (struct tcp_cb *cb, uint32_t seq, uint32_t seglen) {
+    struct tcp_txq_entry *txq;
+    uint64_t now;
+    int covered = 0;
+
+    now = tcp_clock();
+    if (cb->snd.una == cb->snd.max) {
+        /* nothing in flight, the rate is measured from now */
+        cb->delivered_stamp = now;
+    }
+    if (TCP_SEQ_LT(seq, cb->snd.max)) {
+        /* a retransmission, the entries it overlaps were last sent now */
+        for (txq = cb->txq.head; txq; txq = txq->next) {
+            if (TCP_SEQ_LT(txq->seq, seq + seglen) && TCP_SEQ_GT(txq->end, seq)) {
+                txq->flags = (txq->flags | TCP_TXQ_FLG_RETRANSMITTED) & ~TCP_TXQ_FLG_LOST;
+                txq->timestamp = now;
+                txq->delivered = cb->delivered;
+                txq->delivered_stamp = cb->delivered_stamp;
+                if (TCP_SEQ_LEQ(txq->seq, seq) && TCP_SEQ_GEQ(txq->end, seq + seglen)) {
+                    covered = 1;
+                }
+            }
+        }
+        if (covered) {
+            return 0;
+        }
+    }
+    if (cb->txq.free) {
+        txq = cb->txq.free;
+        cb->txq.free = txq->next;
+    } else {
+        txq = malloc(sizeof(struct tcp_txq_entry));
+        if (!txq) {
+            return -1;
+        }
+    }
+    txq->seq = seq;
+    txq->end = seq + seglen;
+    txq->flags = TCP_SEQ_LT(seq, cb->snd.max) ? TCP_TXQ_FLG_RETRANSMITTED : 0;
+    txq->timestamp = now;
+    txq->delivered = cb->delivered;
+    txq->delivered_stamp = cb->delivered_stamp;
+    txq->next = NULL;
+
+    // set txq to next of tail entry
+    if (cb->txq.head == NULL) {
+        cb->txq.head = txq;
+    } else {
+        cb->txq.tail->next = txq;
+    }
+    // update tail entry
+    cb->txq.tail = txq;
+
+    return 0;
+}
+
+static uint16_t
+tcp_mss (struct netif *iface) {
+    return iface->dev->mtu - IP_HDR_SIZE_MIN - sizeof(struct tcp_hdr);
+}
+
+static void
+tcp_options_sack_block (uint8_t *opt, struct tcp_range *range) {
+    uint32_t val;
+
+    val = hton32(range->seq);
+    memcpy(opt, &val, sizeof(val));
+    val = hton32(range->end);
+    memcpy(opt + sizeof(val), &val, sizeof(val));
+}
+
+/* report the out-of-order queue, the range holding the latest segment first (RFC 2018) */
+static size_t
+tcp_options_sack (struct tcp_cb *cb, uint8_t *opt, size_t room) {
+    struct tcp_range *ooo, *first = NULL;
+    int num = 0, max;
+
+    max = MIN(room >= 4 ? (int)(room - 4) / 8 : 0, TCP_SACK_BLOCKS_MAX);
+    if (!max) {
+        return 0;
+    }
+    for (ooo = cb->ooo; ooo; ooo = ooo->next) {
+        if (TCP_SEQ_LEQ(ooo->seq, cb->ooo_recent) && TCP_SEQ_LT(cb->ooo_recent, ooo->end)) {
+            first = ooo;
+        }
+    }
+    if (first) {
+        tcp_options_sack_block(opt + 4 + 8 * num++, first);
+    }
+    for (ooo = cb->ooo; ooo && num < max; ooo = ooo->next) {
+        if (ooo != first) {
+            tcp_options_sack_block(opt + 4 + 8 * num++, ooo);
+        }
+    }
+    opt[0] = TCP_OPTION_NOP;
+    opt[1] = TCP_OPTION_NOP;
+    opt[2] = TCP_OPTION_SACK;
+    opt[3] = 2 + 8 * num;
+    return 4 + 8 * num;
+}
+
+/* our timestamp clock, in milliseconds (RFC 7323 5.4) */
+static uint32_t
+tcp_ts_now (struct tcp_cb *cb) {
+    return (uint32_t)(tcp_clock() / 1000) + cb->ts.offset;
+}
+
+static size_t
+tcp_options_timestamp (struct tcp_cb *cb, uint8_t *opt) {
+    uint32_t val;
+
+    opt[0] = TCP_OPTION_NOP;
+    opt[1] = TCP_OPTION_NOP;
+    opt[2] = TCP_OPTION_TIMESTAMP;
+    opt[3] = TCP_OPTION_TIMESTAMP_LEN;
+    val = hton32(tcp_ts_now(cb));
+    memcpy(opt + 4, &val, sizeof(val));
+    val = hton32(cb->ts.recent);
+    memcpy(opt + 8, &val, sizeof(val));
+    return TCP_OPTION_TIMESTAMP_SPACE;
+}
+
+/* options for a segment carrying len bytes, kept within the interface MTU */
+static size_t
+tcp_options_build (struct tcp_cb *cb, uint8_t flg, uint8_t *opt, size_t len) {
+    size_t optlen = 0, room;
+    uint16_t mss;
+
+    if (TCP_FLG_ISSET(flg, TCP_FLG_SYN)) {
+        mss = hton16(tcp_mss(cb->iface));
+        opt[optlen++] = TCP_OPTION_MSS;
+        opt[optlen++] = TCP_OPTION_MSS_LEN;
+        memcpy(opt + optlen, &mss, sizeof(mss));
+        optlen += sizeof(mss);
+        /* offered on an active open, answered on a passive one */
+        if (!TCP_FLG_ISSET(flg, TCP_FLG_ACK) || (cb->flags & TCP_CB_FLG_WSCALE)) {
+            opt[optlen++] = TCP_OPTION_NOP;
+            opt[optlen++] = TCP_OPTION_WSCALE;
+            opt[optlen++] = TCP_OPTION_WSCALE_LEN;
+            opt[optlen++] = cb->rcv.wscale;
+        }
+        if (!TCP_FLG_ISSET(flg, TCP_FLG_ACK) || (cb->flags & TCP_CB_FLG_SACK_OK)) {
+            opt[optlen++] = TCP_OPTION_NOP;
+            opt[optlen++] = TCP_OPTION_NOP;
+            opt[optlen++] = TCP_OPTION_SACK_PERMITTED;
+            opt[optlen++] = TCP_OPTION_SACK_PERMITTED_LEN;
+        }
+        if (!TCP_FLG_ISSET(flg, TCP_FLG_ACK) || (cb->flags & TCP_CB_FLG_TIMESTAMP)) {
+            optlen += tcp_options_timestamp(cb, opt + optlen);
+        }
+        return optlen;
+    }
+    if ((cb->flags & TCP_CB_FLG_TIMESTAMP) && !TCP_FLG_ISSET(flg, TCP_FLG_RST)) {
+        optlen += tcp_options_timestamp(cb, opt + optlen);
+    }
+    if ((cb->flags & TCP_CB_FLG_SACK_OK) && cb->ooo && TCP_FLG_ISSET(flg, TCP_FLG_ACK)) {
+        room = tcp_mss(cb->iface) > len + optlen ? tcp_mss(cb->iface) - (len + optlen) : 0;
+        optlen += tcp_options_sack(cb, opt + optlen, MIN(room, TCP_HDR_OPTIONS_SIZE_MAX - optlen));
+    }
+    return optlen;
+}
+
+static void
+tcp_options_parse (struct tcp_hdr *hdr, size_t hlen, struct tcp_options *opts) {
+    uint8_t *opt, *end;
+    uint16_t mss;
+    uint32_t val;
+    int n;
+
+    opts->mss = 0;
+    opts->wscale = -1;
+    opts->sack_ok = 0;
+    opts->ts_ok = 0;
+    opts->nsack = 0;
+    opt = (uint8_t *)(hdr + 1);
+    end = (uint8_t *)hdr + hlen;
+    while (opt < end) {
+        if (*opt == TCP_OPTION_EOL) {
+            break;
+        }
+        if (*opt == TCP_OPTION_NOP) {
+            opt++;
+            continue;
+        }
+        if (opt + 1 >= end || opt[1] < 2 || opt + opt[1] > end) {
+            break;
+        }
+        switch (*opt) {
+            case TCP_OPTION_MSS:
+                if (opt[1] == TCP_OPTION_MSS_LEN) {
+                    memcpy(&mss, opt + 2, sizeof(mss));
+                    opts->mss = ntoh16(mss);
+                }
+                break;
+            case TCP_OPTION_WSCALE:
+                if (opt[1] == TCP_OPTION_WSCALE_LEN) {
+                    opts->wscale = opt[2];
+                }
+                break;
+            case TCP_OPTION_SACK_PERMITTED:
+                opts->sack_ok = 1;
+                break;
+            case TCP_OPTION_TIMESTAMP:
+                if (opt[1] == TCP_OPTION_TIMESTAMP_LEN) {
+                    memcpy(&val, opt + 2, sizeof(val));
+                    opts->tsval = ntoh32(val);
+                    memcpy(&val, opt + 6, sizeof(val));
+                    opts->tsecr = ntoh32(val);
+                    opts->ts_ok = 1;
+                }
+                break;
+            case TCP_OPTION_SACK:
+                for (n = 2; n + 8 <= opt[1] && opts->nsack < TCP_SACK_BLOCKS_MAX; n += 8) {
+                    memcpy(&val, opt + n, sizeof(val));
+                    opts->sack[opts->nsack].seq = ntoh32(val);
+                    memcpy(&val, opt + n + 4, sizeof(val));
+                    opts->sack[opts->nsack].end = ntoh32(val);
+                    opts->nsack++;
+                }
+                break;
+            default:
+                break;
+        }
+        opt += opt[1];
+    }
+}
+
+/* the smallest shift that lets the window field cover the receive buffer */
+static uint8_t
+tcp_wscale (size_t size) {
+    uint8_t shift = 0;
+
+    while (shift < TCP_WSCALE_MAX && (size >> shift) > 0xffff) {
+        shift++;
+    }
+    return shift;
+}
+
+/* the window field of an outgoing segment, never scaled on a SYN (RFC 7323 2.2) */
+static uint16_t
+tcp_win_field (struct tcp_cb *cb, uint8_t flg) {
+    uint32_t wnd;
+
+    wnd = TCP_FLG_ISSET(flg, TCP_FLG_SYN) ? cb->rcv.wnd : cb->rcv.wnd >> cb->rcv.wscale;
+    return hton16(MIN(wnd, 0xffffU));
+}
+
+/* the peer's window from an incoming segment */
+static uint32_t
+tcp_snd_wnd (struct tcp_cb *cb, struct tcp_hdr *hdr) {
+    if (TCP_FLG_ISSET(hdr->flg, TCP_FLG_SYN)) {
+        return ntoh16(hdr->win);
+    }
+    return (uint32_t)ntoh16(hdr->win) << cb->snd.wscale;
+}
+
+static uint16_t
+tcp_cksum_addr (ip_addr_t self, ip_addr_t peer, struct tcp_hdr *hdr, size_t len) {
+    uint32_t pseudo = 0;
+
+    pseudo += (self >> 16) & 0xffff;
+    pseudo += self & 0xffff;
+    pseudo += (peer >> 16) & 0xffff;
+    pseudo += peer & 0xffff;
+    pseudo += hton16((uint16_t)IP_PROTOCOL_TCP);
+    pseudo += hton16(len);
+    return cksum16((uint16_t *)hdr, len, pseudo);
+}
+
+static uint16_t
+tcp_cksum (struct tcp_cb *cb, struct tcp_hdr *hdr, size_t len) {
+    return tcp_cksum_addr(((struct netif_ip *)cb->iface)->unicast, cb->peer.addr, hdr, len);
+}
+
+/* send a segment for which there is no TCB (a SYN cookie reply, an ACK from TIME_WAIT) */
+static ssize_t
+tcp_tx_raw (struct netif *iface, ip_addr_t peer, uint16_t src, uint16_t dst, uint32_t seq, uint32_t ack, uint8_t flg, uint16_t win, uint8_t *opt, size_t optlen) {
+    struct pkbuf *pkb;
+    struct tcp_hdr *hdr;
+    ssize_t ret;
+
+    pkb = pkbuf_alloc(0);
+    if (!pkb) {
+        return -1;
+    }
+    if (optlen) {
+        memcpy(pkbuf_push(pkb, optlen), opt, optlen);
+    }
+    hdr = (struct tcp_hdr *)pkbuf_push(pkb, sizeof(struct tcp_hdr));
+    hdr->src = src;
+    hdr->dst = dst;
+    hdr->seq = hton32(seq);
+    hdr->ack = hton32(ack);
+    hdr->off = ((sizeof(struct tcp_hdr) + optlen) >> 2) << 4;
+    hdr->flg = flg;
+    hdr->win = win;
+    hdr->sum = 0;
+    hdr->urg = 0;
+    hdr->sum = tcp_cksum_addr(((struct netif_ip *)iface)->unicast, peer, hdr, pkb->len);
+    ret = ip_tx(iface, IP_PROTOCOL_TCP, pkb, &peer);
+    pkbuf_free(pkb);
+    return ret;
+}
+
+/*
+ * Prepend the header (and options) to the payload already in pkb and
+ * send it. The caller keeps its reference to pkb.
+ */
+static ssize_t
+tcp_tx_pkb (struct tcp_cb *cb, struct pkbuf *pkb, uint32_t seq, uint32_t ack, uint8_t flg) {
+    struct tcp_hdr *hdr;
+    uint8_t opt[TCP_HDR_OPTIONS_SIZE_MAX];
+    size_t optlen, len;
+    uint32_t seglen;
+    ip_addr_t peer;
+
+    len = pkb->len;
+    optlen = tcp_options_build(cb, flg, opt, len);
+    if (optlen) {
+        memcpy(pkbuf_push(pkb, optlen), opt, optlen);
+    }
+    hdr = (struct tcp_hdr *)pkbuf_push(pkb, sizeof(struct tcp_hdr));
+    hdr->src = cb->port;
+    hdr->dst = cb->peer.port;
+    hdr->seq = hton32(seq);
+    hdr->ack = hton32(ack);
+    hdr->off = ((sizeof(struct tcp_hdr) + optlen) >> 2) << 4;
+    hdr->flg = flg;
+    hdr->win = tcp_win_field(cb, flg);
+    hdr->sum = 0;
+    hdr->urg = 0;
+    hdr->sum = tcp_cksum(cb, hdr, pkb->len);
+    peer = cb->peer.addr;
+    seglen = len + (TCP_FLG_ISSET(flg, TCP_FLG_SYN) ? 1 : 0) + (TCP_FLG_ISSET(flg, TCP_FLG_FIN) ? 1 : 0);
+    /* pure ACKs and RSTs are not retransmitted, so never queued */
+    if (seglen && tcp_txq_add(cb, seq, seglen) == -1) {
+        /* not sent, what could not be recorded is sent again later */
+        return -1;
+    }
+    if (TCP_FLG_ISSET(flg, TCP_FLG_ACK)) {
+        /* any segment carries the pending acknowledgment */
+        cb->delack.bytes = 0;
+        cb->delack.expire = 0;
+        cb->ts.last_ack_sent = ack;
+        cb->rcv.adv = ack + ((uint32_t)ntoh16(hdr->win) << (TCP_FLG_ISSET(flg, TCP_FLG_SYN) ? 0 : cb->rcv.wscale));
+    }
+    if (seglen) {
+        if (TCP_SEQ_GT(seq + seglen, cb->snd.max)) {
+            cb->snd.max = seq + seglen;
+        }
+        if (!cb->rtx_expire) {
+            cb->rtx_expire = tcp_clock() + cb->rto;
+            tcp_timer_arm(cb, cb->rtx_expire);
+        }
+    }
+    ip_tx(cb->iface, IP_PROTOCOL_TCP, pkb, &peer);
+    return len;
+}
+
+static ssize_t
+tcp_tx (struct tcp_cb *cb, uint32_t seq, uint32_t ack, uint8_t flg, uint8_t *buf, size_t len) {
+    struct pkbuf *pkb;
+    ssize_t ret;
+
+    pkb = pkbuf_alloc(len);
+    if (!pkb) {
+        return -1;
+    }
+    if (len) {
+        memcpy(pkbuf_put(pkb, len), buf, len);
+    }
+    ret = tcp_tx_pkb(cb, pkb, seq, ack, flg);
+    pkbuf_free(pkb);
+    return ret;
+}
+
+/* send len bytes of the send buffer from offset off */
+static int
+tcp_output_segment (struct tcp_cb *cb, uint32_t off, size_t len, uint8_t flg) {
+    struct pkbuf *pkb;
+
+    pkb = pkbuf_alloc(len);
+    if (!pkb) {
+        return -1;
+    }
+    if (len) {
+        tcp_ring_read(&cb->sndbuf, off, pkbuf_put(pkb, len), len);
+    }
+    if (tcp_tx_pkb(cb, pkb, cb->snd.una + off, cb->rcv.nxt, flg) == -1) {
+        pkbuf_free(pkb);
+        return -1;
+    }
+    pkbuf_free(pkb);
+    return 0;
+}
+
+/* resend [seq, seq + len), which the peer reports missing */
+static void
+tcp_retransmit (struct tcp_cb *cb, uint32_t seq, size_t len) {
+    uint32_t off;
+
+    if (!len) {
+        return;
+    }
+    off = seq - cb->snd.una;
+    tcp_output_segment(cb, off, len, TCP_FLG_ACK | (off + len == cb->sndbuf.len ? TCP_FLG_PSH : 0));
+}
+
+/* SACKed bytes in [snd.una, seq) */
+static uint32_t
+tcp_sack_below (struct tcp_cb *cb, uint32_t seq) {
+    struct tcp_range *range;
+    uint32_t n = 0;
+
+    for (range = cb->sack; range && TCP_SEQ_LT(range->seq, seq); range = range->next) {
+        n += (TCP_SEQ_LT(range->end, seq) ? range->end : seq) - range->seq;
+    }
+    return n;
+}
+
+/*
+ * Estimate of the data still in the network (the pipe of RFC 6675).
+ * Without SACK each duplicate ACK stands for a segment that has left,
+ * which gives limited transmit (RFC 3042) and the window inflation of
+ * fast recovery. In SACK recovery the holes below the highest SACKed
+ * range are taken as lost, leaving what was sent beyond it and the
+ * retransmissions. With RACK only what it has marked lost is left out.
+ */
+static uint32_t
+tcp_flight (struct tcp_cb *cb) {
+    struct tcp_txq_entry *txq;
+    uint32_t off, pipe = 0;
+
+    off = cb->snd.nxt - cb->snd.una;
+    if (!(cb->flags & TCP_CB_FLG_SACK_OK)) {
+        return off - MIN(off, cb->dupacks * (uint32_t)cb->mss);
+    }
+    if (!(cb->flags & TCP_CB_FLG_RECOVERY)) {
+        return off - tcp_sack_below(cb, cb->snd.nxt);
+    }
+    if (cb->flags & TCP_CB_FLG_RACK) {
+        for (txq = cb->txq.head; txq; txq = txq->next) {
+            if (TCP_SEQ_GT(txq->end, cb->snd.una) && !(txq->flags & (TCP_TXQ_FLG_SACKED | TCP_TXQ_FLG_LOST))) {
+                pipe += txq->end - (TCP_SEQ_LT(txq->seq, cb->snd.una) ? cb->snd.una : txq->seq);
+            }
+        }
+        return pipe;
+    }
+    if (TCP_SEQ_GT(cb->snd.nxt, cb->sack_high)) {
+        pipe += cb->snd.nxt - cb->sack_high;
+    }
+    if (TCP_SEQ_GT(cb->rtx_next, cb->snd.una)) {
+        pipe += cb->rtx_next - cb->snd.una - tcp_sack_below(cb, cb->rtx_next);
+    }
+    return pipe;
+}
+
+/* the next hole below the highest SACKed range not yet retransmitted */
+static size_t
+tcp_sack_hole (struct tcp_cb *cb, uint32_t *seq) {
+    struct tcp_range *range;
+    uint32_t start, end;
+
+    start = TCP_SEQ_GT(cb->rtx_next, cb->snd.una) ? cb->rtx_next : cb->snd.una;
+    for (range = cb->sack; range; range = range->next) {
+        if (TCP_SEQ_GT(range->seq, start)) {
+            break;
+        }
+        if (TCP_SEQ_GT(range->end, start)) {
+            start = range->end;
+        }
+    }
+    if (!range) {
+        return 0;
+    }
+    end = range->seq;
+    *seq = start;
+    return MIN(MIN(end - start, (uint32_t)cb->mss), (uint32_t)(cb->sndbuf.len - (start - cb->snd.una)));
+}
+
+/* the first segment RACK has marked lost and that has not been resent since */
+static size_t
+tcp_rack_lost (struct tcp_cb *cb, uint32_t *seq) {
+    struct tcp_txq_entry *txq;
+    uint32_t start, len;
+
+    for (txq = cb->txq.head; txq; txq = txq->next) {
+        if ((txq->flags & (TCP_TXQ_FLG_LOST | TCP_TXQ_FLG_SACKED)) != TCP_TXQ_FLG_LOST || TCP_SEQ_LEQ(txq->end, cb->snd.una)) {
+            continue;
+        }
+        start = TCP_SEQ_LT(txq->seq, cb->snd.una) ? cb->snd.una : txq->seq;
+        /* a lone FIN is left to the retransmission timer */
+        len = MIN(MIN(txq->end - start, (uint32_t)cb->mss), (uint32_t)(cb->sndbuf.len - (start - cb->snd.una)));
+        if (len) {
+            *seq = start;
+            return len;
+        }
+    }
+    return 0;
+}
+
+/* the scoreboard range holding seq, if any */
+static struct tcp_range *
+tcp_sack_lookup (struct tcp_cb *cb, uint32_t seq) {
+    struct tcp_range *range;
+
+    for (range = cb->sack; range && TCP_SEQ_LEQ(range->seq, seq); range = range->next) {
+        if (TCP_SEQ_LT(seq, range->end)) {
+            return range;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Arm the tail loss probe (RFC 8985 7.2): two round trips, plus a
+ * delayed ACK when only one segment is out. The RTO is left to fire
+ * instead if it comes first.
+ */
+static void
+tcp_tlp_arm (struct tcp_cb *cb, uint64_t now) {
+    uint64_t pto;
+
+    cb->tlp.expire = 0;
+    if ((cb->flags & (TCP_CB_FLG_RACK | TCP_CB_FLG_SACK_OK)) != (TCP_CB_FLG_RACK | TCP_CB_FLG_SACK_OK)) {
+        return;
+    }
+    if ((cb->flags & TCP_CB_FLG_RECOVERY) || cb->tlp.sent || !cb->srtt || cb->snd.una == cb->snd.max) {
+        return;
+    }
+    pto = 2 * (uint64_t)cb->srtt;
+    if (cb->snd.max - cb->snd.una <= cb->mss) {
+        pto += TCP_TLP_DELACK_MAX;
+    }
+    if (!cb->rtx_expire || now + pto < cb->rtx_expire) {
+        cb->tlp.expire = now + pto;
+        tcp_timer_arm(cb, cb->tlp.expire);
+    }
+}
+
+/*
+ * With data waiting, nothing in flight and the peer's window closed, no
+ * ACK is due that would reopen it. The persist timer then sends window
+ * probes, backing off like the RTO but never giving up (RFC 9293
+ * 3.8.6.1).
+ */
+static void
+tcp_persist_arm (struct tcp_cb *cb, uint64_t now) {
+    uint32_t off;
+    uint64_t timeout;
+
+    off = cb->snd.nxt - cb->snd.una;
+    if (cb->snd.una != cb->snd.max || off >= cb->sndbuf.len || cb->snd.wnd > off) {
+        cb->persist.expire = 0;
+        cb->persist.probes = 0;
+        return;
+    }
+    if (!cb->persist.expire) {
+        timeout = (uint64_t)cb->rto << MIN(cb->persist.probes, 16);
+        cb->persist.expire = now + MIN(timeout, (uint64_t)TCP_RTO_MAX);
+        tcp_timer_arm(cb, cb->persist.expire);
+    }
+}
+
+/*
+ * Send as much of the send buffer as the peer's window and the
+ * congestion window allow, cut into MSS-sized segments, followed by the
+ * FIN once close has been requested. In SACK recovery the holes (or
+ * what RACK marked lost) go out first, and data the peer already holds
+ * is never sent again.
+ */
+static void
+tcp_output (struct tcp_cb *cb) {
+    struct tcp_range *range;
+    uint32_t off, flight, seq, nxt;
+    size_t wnd, len;
+    uint8_t flg;
+    uint64_t now;
+
+    if (!TCP_CB_STATE_SND_ISREADY(cb) || cb->snd.una == cb->iss) {
+        return;
+    }
+    if (cb->cc.pacing_rate) {
+        /* credit accrues at the pacing rate, bursts are limited to about 1 ms */
+        now = tcp_clock();
+        cb->pacing_credit += cb->cc.pacing_rate * MIN(now - cb->pacing_stamp, (uint64_t)1000000) / 1000000;
+        cb->pacing_credit = MIN(cb->pacing_credit, MAX(cb->cc.pacing_rate / 1000, 2 * (uint64_t)cb->mss));
+        cb->pacing_stamp = now;
+    }
+    flight = tcp_flight(cb);
+    if ((cb->flags & TCP_CB_FLG_RECOVERY) && (cb->flags & TCP_CB_FLG_SACK_OK)) {
+        while ((len = cb->flags & TCP_CB_FLG_RACK ? tcp_rack_lost(cb, &seq) : tcp_sack_hole(cb, &seq)) && flight + len <= cb->cc.cwnd) {
+            tcp_retransmit(cb, seq, len);
+            cb->rtx_next = seq + len;
+            flight += len;
+        }
+    }
+    nxt = cb->snd.nxt;
+    while ((off = cb->snd.nxt - cb->snd.una) <= cb->sndbuf.len) {
+        if (TCP_SEQ_LT(cb->snd.nxt, cb->snd.max) && (range = tcp_sack_lookup(cb, cb->snd.nxt))) {
+            /* resending after a timeout, skip what the peer holds */
+            cb->snd.nxt = range->end;
+            continue;
+        }
+        wnd = cb->snd.wnd > off ? cb->snd.wnd - off : 0;
+        wnd = MIN(wnd, (size_t)(cb->cc.cwnd > flight ? cb->cc.cwnd - flight : 0));
+        len = MIN(cb->sndbuf.len - off, MIN((size_t)cb->mss, wnd));
+        if (len < cb->mss && off + len < cb->sndbuf.len && off) {
+            /* wait for the window to open by a full segment */
+            break;
+        }
+        if (len < cb->mss && off + len == cb->sndbuf.len && !(cb->flags & TCP_CB_FLG_FIN_PENDING) && TCP_SEQ_GEQ(cb->snd.nxt, cb->snd.max)) {
+            /* a small segment waits for more data while corked, or for the outstanding data to be acknowledged (RFC 896) */
+            if ((cb->flags & TCP_CB_FLG_CORK) || (!(cb->flags & TCP_CB_FLG_NODELAY) && cb->snd.una != cb->snd.max)) {
+                break;
+            }
+        }
+        if (cb->cc.pacing_rate && off && cb->pacing_credit < len) {
+            /* the next ACK resumes output */
+            break;
+        }
+        flg = TCP_FLG_ACK;
+        if (off + len == cb->sndbuf.len) {
+            if (cb->flags & TCP_CB_FLG_FIN_PENDING) {
+                flg |= TCP_FLG_FIN;
+            }
+            if (len) {
+                flg |= TCP_FLG_PSH;
+            }
+        }
+        if (!len && !TCP_FLG_ISSET(flg, TCP_FLG_FIN)) {
+            break;
+        }
+        if (tcp_output_segment(cb, off, len, flg) == -1) {
+            break;
+        }
+        cb->snd.nxt += len;
+        flight += len;
+        cb->pacing_credit -= MIN(cb->pacing_credit, (uint64_t)len);
+        if (TCP_FLG_ISSET(flg, TCP_FLG_FIN)) {
+            cb->snd.nxt++;
+            cb->flags |= TCP_CB_FLG_FIN_SENT;
+        }
+    }
+    now = tcp_clock();
+    if (cb->snd.nxt != nxt) {
+        tcp_tlp_arm(cb, now);
+    }
+    tcp_persist_arm(cb, now);
+}
+
+/*
+ * Acknowledge received data, see RFC 1122 4.2.3.2 and RFC 5681 4.2: at
+ * least every second full-sized segment and within TCP_DELACK_TIMEOUT,
+ * but at once for out-of-order data or data filling a gap, which the
+ * sender's loss recovery is waiting on.
+ */
+static void
+tcp_delack (struct tcp_cb *cb, size_t len, int immediate) {
+    cb->delack.bytes += len;
+    if (immediate || cb->delack.bytes >= 2 * (uint32_t)cb->mss) {
+        tcp_tx(cb, cb->snd.nxt, cb->rcv.nxt, TCP_FLG_ACK, NULL, 0);
+        return;
+    }
+    if (!cb->delack.expire) {
+        cb->delack.expire = tcp_clock() + TCP_DELACK_TIMEOUT;
+        tcp_timer_arm(cb, cb->delack.expire);
+    }
+}
+
+/* add [seq, end) to a sorted range list, merging adjacent ranges */
+static int
+tcp_range_add (struct tcp_range **list, int *num, uint32_t seq, uint32_t end, uint8_t fin) {
+    struct tcp_range **entry, *range, *next;
+
+    for (entry = list; *entry && TCP_SEQ_LT((*entry)->end, seq); entry = &(*entry)->next);
+    range = *entry;
+    if (range && TCP_SEQ_LEQ(range->seq, end)) {
+        if (TCP_SEQ_LT(seq, range->seq)) {
+            range->seq = seq;
+        }
+        if (TCP_SEQ_GT(end, range->end)) {
+            range->end = end;
+        }
+        range->fin |= fin;
+        while ((next = range->next) && TCP_SEQ_LEQ(next->seq, range->end)) {
+            if (TCP_SEQ_GT(next->end, range->end)) {
+                range->end = next->end;
+            }
+            range->fin |= next->fin;
+            range->next = next->next;
+            free(next);
+            (*num)--;
+        }
+        return 0;
+    }
+    if (*num >= TCP_RANGE_ENTRY_MAX) {
+        return -1;
+    }
+    range = malloc(sizeof(struct tcp_range));
+    if (!range) {
+        return -1;
+    }
+    range->seq = seq;
+    range->end = end;
+    range->fin = fin;
+    range->next = *entry;
+    *entry = range;
+    (*num)++;
+    return 0;
+}
+
+/*
+ * Accept segment data into the receive ring. In-sequence data advances
+ * rcv.nxt together with any queued ranges it makes contiguous; data
+ * beyond a gap is stored at its offset and remembered in the
+ * out-of-order queue. Returns 1 if the FIN has been reached in sequence.
+ */
+static int
+tcp_rcv_data (struct tcp_cb *cb, uint32_t seq, uint8_t *data, size_t len, uint8_t fin) {
+    struct tcp_range *ooo;
+    uint32_t n;
+
+    if (TCP_SEQ_LT(seq, cb->rcv.nxt)) {
+        n = cb->rcv.nxt - seq;
+        data += n;
+        len -= n;
+        seq = cb->rcv.nxt;
+    }
+    if (len > cb->rcv.wnd - (seq - cb->rcv.nxt)) {
+        len = cb->rcv.wnd - (seq - cb->rcv.nxt);
+        fin = 0;
+    }
+    if (len && tcp_ring_store(&cb->rcvbuf, seq - cb->rcv.nxt, data, len) != len) {
+        return 0;
+    }
+    if (seq != cb->rcv.nxt) {
+        tcp_range_add(&cb->ooo, &cb->nooo, seq, seq + len, fin);
+        cb->ooo_recent = seq;
+        return 0;
+    }
+    tcp_ring_commit(&cb->rcvbuf, len);
+    cb->rcv.nxt += len;
+    cb->rcv.wnd -= len;
+    while ((ooo = cb->ooo) && TCP_SEQ_LEQ(ooo->seq, cb->rcv.nxt)) {
+        if (TCP_SEQ_GT(ooo->end, cb->rcv.nxt)) {
+            n = ooo->end - cb->rcv.nxt;
+            tcp_ring_commit(&cb->rcvbuf, n);
+            cb->rcv.nxt += n;
+            cb->rcv.wnd -= n;
+        }
+        fin |= ooo->fin;
+        cb->ooo = ooo->next;
+        free(ooo);
+        cb->nooo--;
+    }
+    return fin;
+}
+
+/*
+ * PAWS (RFC 7323 5): a timestamp older than TS.Recent marks an old
+ * duplicate, unless the connection has been idle long enough for the
+ * peer's clock to wrap.
+ */
+static int
+tcp_paws_reject (struct tcp_cb *cb, struct tcp_options *opts) {
+    if (!cb->ts.recent_stamp || TCP_SEQ_GEQ(opts->tsval, cb->ts.recent)) {
+        return 0;
+    }
+    if (tcp_clock() - cb->ts.recent_stamp > TCP_PAWS_IDLE) {
+        cb->ts.recent_stamp = 0;
+        return 0;
+    }
+    return 1;
+}
+
+/* segment acceptability test, see RFC 793 (SEGMENT ARRIVES) */
+static int
+tcp_seq_acceptable (struct tcp_cb *cb, uint32_t seq, size_t len) {
+    if (!cb->rcv.wnd) {
+        return !len && seq == cb->rcv.nxt;
+    }
+    if (TCP_SEQ_LEQ(cb->rcv.nxt, seq) && TCP_SEQ_LT(seq, cb->rcv.nxt + cb->rcv.wnd)) {
+        return 1;
+    }
+    return len && TCP_SEQ_LEQ(cb->rcv.nxt, seq + len - 1) && TCP_SEQ_LT(seq + len - 1, cb->rcv.nxt + cb->rcv.wnd);
+}
+
+/* update SRTT, RTTVAR and RTO with a new sample, see RFC 6298 */
+static void
+tcp_rtt_sample (struct tcp_cb *cb, uint32_t rtt) {
+    uint32_t delta;
+
+    if (!cb->srtt) {
+        cb->srtt = rtt ? rtt : 1;
+        cb->rttvar = rtt / 2;
+    } else {
+        delta = cb->srtt > rtt ? cb->srtt - rtt : rtt - cb->srtt;
+        cb->rttvar = (3 * cb->rttvar + delta) / 4;
+        cb->srtt = (7 * cb->srtt + rtt) / 8;
+    }
+    cb->rto = cb->srtt + MAX((uint32_t)TCP_CLOCK_GRANULARITY, 4 * cb->rttvar);
+    cb->rto = MIN(MAX(cb->rto, (uint32_t)TCP_RTO_MIN), (uint32_t)TCP_RTO_MAX);
+}
+
+/*
+ * The timer backs off exponentially with each consecutive timeout. The
+ * backoff is cleared as soon as an ACK makes progress, so that a burst of
+ * losses does not keep the connection at an inflated timeout.
+ */
+static uint32_t
+tcp_rto_backoff (struct tcp_cb *cb) {
+    uint64_t rto;
+
+    rto = (uint64_t)cb->rto << MIN(cb->retransmits, 16);
+    return MIN(rto, (uint64_t)TCP_RTO_MAX);
+}
+
+/*
+ * A segment has been delivered (acknowledged or SACKed), see RFC 8985
+ * 6.2. A retransmission acknowledged faster than the minimum RTT was
+ * probably delivered by its original transmission and is not used.
+ */
+static void
+tcp_rack_update (struct tcp_cb *cb, struct tcp_txq_entry *txq, uint64_t now) {
+    uint32_t rtt;
+
+    rtt = (uint32_t)MAX(now - txq->timestamp, (uint64_t)1);
+    if (txq->flags & TCP_TXQ_FLG_RETRANSMITTED) {
+        if (rtt < cb->rack.min_rtt) {
+            return;
+        }
+    } else if (!cb->rack.min_rtt || rtt < cb->rack.min_rtt) {
+        cb->rack.min_rtt = rtt;
+    }
+    if (txq->timestamp > cb->rack.xmit_ts || (txq->timestamp == cb->rack.xmit_ts && TCP_SEQ_GT(txq->end, cb->rack.end_seq))) {
+        cb->rack.xmit_ts = txq->timestamp;
+        cb->rack.end_seq = txq->end;
+        cb->rack.rtt = rtt;
+    }
+}
+
+/*
+ * RACK loss detection (RFC 8985 6.2): a segment is lost once one sent
+ * after it has been delivered and a reordering window of a quarter of
+ * the minimum RTT has passed on top of the RTT. Segments still within
+ * the window arm the reordering timer. Returns 1 if any was marked.
+ */
+static int
+tcp_rack_detect (struct tcp_cb *cb, uint64_t now) {
+    struct tcp_txq_entry *txq;
+    uint64_t deadline;
+    uint32_t reo_wnd;
+    int lost = 0;
+
+    cb->rack.expire = 0;
+    if (!cb->rack.xmit_ts || cb->snd.una == cb->snd.max) {
+        return 0;
+    }
+    reo_wnd = cb->srtt ? MIN(cb->rack.min_rtt / 4, cb->srtt) : cb->rack.min_rtt / 4;
+    for (txq = cb->txq.head; txq; txq = txq->next) {
+        if (TCP_SEQ_LEQ(txq->end, cb->snd.una) || (txq->flags & (TCP_TXQ_FLG_SACKED | TCP_TXQ_FLG_LOST))) {
+            continue;
+        }
+        if (txq->timestamp > cb->rack.xmit_ts || (txq->timestamp == cb->rack.xmit_ts && TCP_SEQ_GEQ(txq->end, cb->rack.end_seq))) {
+            continue;
+        }
+        deadline = txq->timestamp + cb->rack.rtt + reo_wnd;
+        if (deadline <= now) {
+            txq->flags |= TCP_TXQ_FLG_LOST;
+            lost = 1;
+        } else if (!cb->rack.expire || deadline < cb->rack.expire) {
+            cb->rack.expire = deadline;
+            tcp_timer_arm(cb, cb->rack.expire);
+        }
+    }
+    return lost;
+}
+
+/*
+ * Release the transmit queue entries covered by snd.una. The newest one
+ * gives an RTT sample unless the ACK covers a retransmitted segment,
+ * which makes the measurement ambiguous (Karn's algorithm), and a
+ * delivery rate sample: the bytes acknowledged since it was sent over
+ * the time that took. The echoed timestamp, when there is one, still
+ * tells which transmission was acknowledged (RFC 7323 4).
+ */
+static void
+tcp_txq_ack (struct tcp_cb *cb, uint64_t now, struct tcp_options *opts, struct tcp_cc_ack *sample) {
+    struct tcp_txq_entry *txq;
+    int64_t rtt = -1;
+    int ambiguous = 0;
+    uint32_t ts;
+
+    sample->prior_delivered = 0;
+    sample->rate = 0;
+    while ((txq = cb->txq.head) && TCP_SEQ_LEQ(txq->end, cb->snd.una)) {
+        if (txq->flags & TCP_TXQ_FLG_RETRANSMITTED) {
+            ambiguous = 1;
+        } else {
+            rtt = now - txq->timestamp;
+        }
+        tcp_rack_update(cb, txq, now);
+        sample->prior_delivered = txq->delivered;
+        sample->rate = now > txq->delivered_stamp ? (cb->delivered - txq->delivered) * 1000000 / (now - txq->delivered_stamp) : 0;
+        cb->txq.head = txq->next;
+        txq->next = cb->txq.free;
+        cb->txq.free = txq;
+    }
+    if (!cb->txq.head) {
+        cb->txq.tail = NULL;
+    }
+    if ((rtt < 0 || ambiguous) && (cb->flags & TCP_CB_FLG_TIMESTAMP) && opts->ts_ok) {
+        ts = tcp_ts_now(cb);
+        if (TCP_SEQ_GEQ(ts, opts->tsecr)) {
+            /* a millisecond clock, half a tick is added */
+            rtt = (int64_t)(ts - opts->tsecr) * 1000 + 500;
+            ambiguous = 0;
+        }
+    }
+    sample->rtt = 0;
+    if (rtt >= 0 && !ambiguous) {
+        sample->rtt = (uint32_t)MAX(rtt, 1);
+        tcp_rtt_sample(cb, sample->rtt);
+    }
+}
+
+/*
+ * Merge the peer's SACK blocks into the scoreboard and drop what snd.una
+ * covers. Segments that become wholly SACKed count as delivered for RACK.
+ */
+static void
+tcp_sack_update (struct tcp_cb *cb, struct tcp_options *opts, uint64_t now) {
+    struct tcp_txq_entry *txq;
+    struct tcp_range *range;
+    int n;
+
+    for (n = 0; n < opts->nsack; n++) {
+        if (TCP_SEQ_LT(opts->sack[n].seq, opts->sack[n].end) && TCP_SEQ_LT(cb->snd.una, opts->sack[n].end) && TCP_SEQ_LEQ(opts->sack[n].end, cb->snd.max)) {
+            tcp_range_add(&cb->sack, &cb->nsack, TCP_SEQ_LT(opts->sack[n].seq, cb->snd.una) ? cb->snd.una : opts->sack[n].seq, opts->sack[n].end, 0);
+        }
+    }
+    while ((range = cb->sack) && TCP_SEQ_LEQ(range->end, cb->snd.una)) {
+        cb->sack = range->next;
+        free(range);
+        cb->nsack--;
+    }
+    if (range && TCP_SEQ_LT(range->seq, cb->snd.una)) {
+        range->seq = cb->snd.una;
+    }
+    cb->sacked = 0;
+    cb->sack_high = cb->snd.una;
+    for (range = cb->sack; range; range = range->next) {
+        cb->sacked += range->end - range->seq;
+        cb->sack_high = range->end;
+    }
+    if (!opts->nsack) {
+        return;
+    }
+    for (txq = cb->txq.head; txq; txq = txq->next) {
+        if ((txq->flags & TCP_TXQ_FLG_SACKED) || TCP_SEQ_LEQ(txq->end, cb->snd.una)) {
+            continue;
+        }
+        range = tcp_sack_lookup(cb, TCP_SEQ_LT(txq->seq, cb->snd.una) ? cb->snd.una : txq->seq);
+        if (range && TCP_SEQ_LEQ(txq->end, range->end)) {
+            txq->flags = (txq->flags | TCP_TXQ_FLG_SACKED) & ~TCP_TXQ_FLG_LOST;
+            tcp_rack_update(cb, txq, now);
+        }
+    }
+}
+
+/*
+ * Fast retransmit (RFC 5681) on the third duplicate ACK or once more
+ * than two segments beyond snd.una have been SACKed (RFC 6675), or as
+ * soon as RACK marks a segment lost. The
+ * congestion control module sets the window for the recovery, which
+ * lasts until everything sent so far is acknowledged (RFC 6582).
+ */
+static void
+tcp_enter_recovery (struct tcp_cb *cb) {
+    size_t len;
+
+    cb->flags |= TCP_CB_FLG_RECOVERY;
+    cb->recover = cb->snd.max;
+    cb->tlp.expire = 0;
+    cb->cc.ops->on_loss(&cb->cc, cb->snd.max - cb->snd.una);
+    len = MIN(cb->sndbuf.len, (size_t)cb->mss);
+    tcp_retransmit(cb, cb->snd.una, len);
+    cb->rtx_next = cb->snd.una + len;
+}
+
+/* process an acceptable ACK, see RFC 793 (SEGMENT ARRIVES) */
+static void
+tcp_ack (struct tcp_cb *cb, struct tcp_hdr *hdr, size_t plen, struct tcp_options *opts) {
+    uint32_t seq, ack, acked, segs;
+    struct tcp_cc_ack sample;
+    uint64_t now;
+    int advanced, dsack = 0, rack, lost = 0;
+
+    seq = ntoh32(hdr->seq);
+    ack = ntoh32(hdr->ack);
+    now = tcp_clock();
+    advanced = TCP_SEQ_LT(cb->snd.una, ack);
+    if (ack == cb->snd.una && cb->snd.una != cb->snd.max && !plen && !TCP_FLG_ISSET(hdr->flg, TCP_FLG_SYN | TCP_FLG_FIN) && tcp_snd_wnd(cb, hdr) == cb->snd.wnd) {
+        cb->dupacks++;
+    }
+    if (TCP_SEQ_LT(cb->snd.una, ack)) {
+        acked = MIN(ack - cb->snd.una, (uint32_t)cb->sndbuf.len);
+        if (acked) {
+            tcp_ring_consume(&cb->sndbuf, acked);
+            pthread_cond_broadcast(&cb->cond);
+        }
+        cb->snd.una = ack;
+        if (TCP_SEQ_LT(cb->snd.nxt, ack)) {
+            cb->snd.nxt = ack;
+        }
+        if (acked) {
+            cb->delivered += acked;
+            cb->delivered_stamp = now;
+        }
+        tcp_txq_ack(cb, now, opts, &sample);
+        if (cb->flags & TCP_CB_FLG_RECOVERY && TCP_SEQ_LT(ack, cb->recover)) {
+            /* partial ACK, the next hole is lost too */
+            segs = (acked + cb->mss - 1) / cb->mss;
+            cb->dupacks -= MIN(cb->dupacks, segs ? segs - 1 : 0);
+            if (TCP_SEQ_LT(cb->rtx_next, ack)) {
+                cb->rtx_next = ack;
+            }
+            if (!(cb->flags & TCP_CB_FLG_SACK_OK) || !cb->sack) {
+                tcp_retransmit(cb, ack, MIN(cb->sndbuf.len, (size_t)cb->mss));
+            }
+        } else {
+            cb->flags &= ~TCP_CB_FLG_RECOVERY;
+            cb->dupacks = 0;
+        }
+        cb->retransmits = 0;
+        /* RFC 6298 (5.2), (5.3) */
+        cb->rtx_expire = cb->snd.una == cb->snd.max ? 0 : now + cb->rto;
+        tcp_timer_arm(cb, cb->rtx_expire);
+        if (acked) {
+            sample.acked = acked;
+            sample.inflight = cb->snd.max - cb->snd.una;
+            sample.srtt = cb->srtt;
+            sample.now = now;
+            sample.delivered = cb->delivered;
+            sample.recovery = cb->flags & TCP_CB_FLG_RECOVERY ? 1 : 0;
+            cb->cc.ops->on_ack(&cb->cc, &sample);
+        }
+    }
+    if (cb->flags & TCP_CB_FLG_SACK_OK) {
+        tcp_sack_update(cb, opts, now);
+        /* a duplicate reported below the ACK or inside the next block (RFC 2883) */
+        dsack = opts->nsack && (TCP_SEQ_LEQ(opts->sack[0].end, ack) || (opts->nsack > 1 && TCP_SEQ_LEQ(opts->sack[1].seq, opts->sack[0].seq) && TCP_SEQ_LEQ(opts->sack[0].end, opts->sack[1].end)));
+    }
+    if (cb->tlp.sent && TCP_SEQ_GEQ(ack, cb->tlp.end)) {
+        /*
+         * The probe's episode ends (RFC 8985 7.4). A resent segment that
+         * no DSACK reports as a duplicate has repaired a loss, which
+         * congestion control must hear about. A pure duplicate ACK at
+         * the probe's end means both copies arrived.
+         */
+        if (!cb->tlp.retrans || dsack || !advanced) {
+            cb->tlp.sent = 0;
+        } else if (TCP_SEQ_GT(ack, cb->tlp.end)) {
+            if (!(cb->flags & TCP_CB_FLG_RECOVERY)) {
+                cb->cc.ops->on_loss(&cb->cc, cb->snd.max - cb->snd.una);
+            }
+            cb->tlp.sent = 0;
+        }
+    }
+    rack = (cb->flags & (TCP_CB_FLG_RACK | TCP_CB_FLG_SACK_OK)) == (TCP_CB_FLG_RACK | TCP_CB_FLG_SACK_OK);
+    if (rack) {
+        lost = tcp_rack_detect(cb, now);
+    }
+    if (!(cb->flags & TCP_CB_FLG_RECOVERY) && TCP_SEQ_GT(cb->snd.una, cb->recover)) {
+        /* RACK replaces the duplicate ACK threshold, which reordering trips */
+        if (rack ? lost : (cb->dupacks >= 3 || cb->sacked > 2 * (uint32_t)cb->mss)) {
+            tcp_enter_recovery(cb);
+        }
+    }
+    if (advanced) {
+        tcp_tlp_arm(cb, now);
+    }
+    if (TCP_SEQ_LT(cb->snd.wl1, seq) || (cb->snd.wl1 == seq && TCP_SEQ_LEQ(cb->snd.wl2, ack))) {
+        cb->snd.wnd = tcp_snd_wnd(cb, hdr);
+        cb->snd.wl1 = seq;
+        cb->snd.wl2 = ack;
+    }
+}
+
+/* the MSS is known once the SYN arrives, which also starts congestion control */
+static void
+tcp_set_mss (struct tcp_cb *cb, struct tcp_options *opts) {
+    cb->mss = MIN(opts->mss ? opts->mss : TCP_DEFAULT_MSS, tcp_mss(cb->iface));
+    if (cb->flags & TCP_CB_FLG_TIMESTAMP) {
+        /* the MSS does not account for options (RFC 6691) */
+        cb->mss -= TCP_OPTION_TIMESTAMP_SPACE;
+    }
+    cb->cc.mss = cb->mss;
+    /* initial window, see RFC 6928 */
+    cb->cc.cwnd = MIN(10 * cb->cc.mss, MAX(2 * cb->cc.mss, 14600U));
+    cb->cc.ssthresh = TCP_CC_CWND_MAX;
+    cb->cc.pacing_rate = 0;
+    cb->cc.ops->init(&cb->cc);
+}
+
+/* the passive child is no longer half-open, the caller holds the listener's mutex */
+static void
+tcp_synq_leave (struct tcp_cb *cb) {
+    if (cb->flags & TCP_CB_FLG_SYNQ) {
+        cb->flags &= ~TCP_CB_FLG_SYNQ;
+        cb->parent->nsynq--;
+    }
+}
+
+/*
+ * Discard a passive child that was never accepted. The caller holds a
+ * reference of its own; the tables' reference is dropped here.
+ */
+static void
+tcp_child_drop (struct tcp_cb *cb) {
+    pthread_mutex_lock(&cb->parent->mutex);
+    tcp_synq_leave(cb);
+    pthread_mutex_unlock(&cb->parent->mutex);
+    cb->state = TCP_CB_STATE_CLOSED;
+    cb->rtx_expire = 0;
+    pthread_rwlock_wrlock(&table_lock);
+    tcp_cb_unlink(cb);
+    pthread_rwlock_unlock(&table_lock);
+    tcp_cb_put(cb);
+}
+
+/*
+ * Take a passive child out of its listener's accept queues, letting a
+ * child from the overflow queue into the backlog in its place. Returns -1
+ * if it is in neither, because it has been accepted or is half-open.
+ */
+static int
+tcp_child_unqueue (struct tcp_cb *cb) {
+    struct tcp_cb *lcb;
+    struct queue_head *queue;
+    struct queue_entry **entry, *prev, *tmp;
+
+    lcb = cb->parent;
+    pthread_mutex_lock(&lcb->mutex);
+    for (queue = &lcb->backlog; queue; queue = (queue == &lcb->backlog ? &lcb->overflow : NULL)) {
+        prev = NULL;
+        for (entry = &queue->next; *entry; prev = *entry, entry = &(*entry)->next) {
+            if ((*entry)->data != cb) {
+                continue;
+            }
+            tmp = *entry;
+            *entry = tmp->next;
+            if (queue->tail == tmp) {
+                queue->tail = prev;
+            }
+            queue->num--;
+            free(tmp);
+            if (queue == &lcb->backlog && lcb->overflow.next && queue_push(&lcb->backlog, lcb->overflow.next->data, sizeof(struct tcp_cb))) {
+                free(queue_pop(&lcb->overflow));
+                pthread_cond_signal(&lcb->cond);
+            }
+            pthread_mutex_unlock(&lcb->mutex);
+            return 0;
+        }
+    }
+    pthread_mutex_unlock(&lcb->mutex);
+    return -1;
+}
+
+/*
+ * The handshake is complete, queue the child for tcp_api_accept(). While
+ * the backlog is full the child waits in the overflow queue, which counts
+ * against synq_max, and tcp_api_accept() moves it on. A child from the
+ * half-open queue keeps its share; a child made for a cookie has none and
+ * is refused if no share is left.
+ */
+static int
+tcp_child_establish (struct tcp_cb *cb) {
+    struct tcp_cb *lcb;
+    struct queue_head *queue;
+
+    lcb = cb->parent;
+    pthread_mutex_lock(&lcb->mutex);
+    if (lcb->state != TCP_CB_STATE_LISTEN) {
+        /* the listener has been closed */
+        pthread_mutex_unlock(&lcb->mutex);
+        return -1;
+    }
+    if (lcb->backlog.num < (unsigned int)lcb->backlog_max) {
+        queue = &lcb->backlog;
+    } else if ((cb->flags & TCP_CB_FLG_SYNQ) || lcb->nsynq + (int)lcb->overflow.num < lcb->synq_max) {
+        queue = &lcb->overflow;
+    } else {
+        pthread_mutex_unlock(&lcb->mutex);
+        return -1;
+    }
+    if (!queue_push(queue, cb, sizeof(*cb))) {
+        pthread_mutex_unlock(&lcb->mutex);
+        return -1;
+    }
+    cb->state = TCP_CB_STATE_ESTABLISHED;
+    tcp_synq_leave(cb);
+    if (queue == &lcb->backlog) {
+        pthread_cond_signal(&lcb->cond);
+    }
+    pthread_mutex_unlock(&lcb->mutex);
+    return 0;
+}
+
+/*
+ * The connection is gone, reset by the peer or given up on. A passive
+ * child that tcp_api_accept() has not handed out is discarded, as no one
+ * would close it; otherwise the user finds the TCB CLOSED.
+ */
+static void
+tcp_abort (struct tcp_cb *cb) {
+    if (cb->parent && (cb->state == TCP_CB_STATE_SYN_RCVD || tcp_child_unqueue(cb) == 0)) {
+        tcp_child_drop(cb);
+        return;
+    }
+    cb->rtx_expire = 0;
+    cb->state = TCP_CB_STATE_CLOSED;
+    pthread_cond_broadcast(&cb->cond);
+}
+
+/*
+ * The listener is closing, refuse the children tcp_api_accept() has not
+ * handed out, queued or half-open, with a RST. Called with the listener's
+ * mutex held, which is let go while the children are locked.
+ */
+static void
+tcp_listen_close (struct tcp_cb *lcb) {
+    struct queue_head children;
+    struct queue_entry *entry;
+    struct tcp_cb *cb;
+    int more;
+
+    lcb->state = TCP_CB_STATE_CLOSED;
+    pthread_cond_broadcast(&lcb->cond);
+    do {
+        memset(&children, 0, sizeof(children));
+        more = 0;
+        pthread_rwlock_rdlock(&table_lock);
+        for (cb = cb_list; cb; cb = cb->next) {
+            if (cb->parent != lcb || cb->desc != -1 || cb->state == TCP_CB_STATE_CLOSED || cb->state == TCP_CB_STATE_TIME_WAIT) {
+                continue;
+            }
+            if (!queue_push(&children, cb, sizeof(*cb))) {
+                /* short of memory, go again after these */
+                more = children.num != 0;
+                break;
+            }
+            tcp_cb_get(cb);
+        }
+        pthread_rwlock_unlock(&table_lock);
+        pthread_mutex_unlock(&lcb->mutex);
+        while ((entry = queue_pop(&children))) {
+            cb = entry->data;
+            free(entry);
+            pthread_mutex_lock(&cb->mutex);
+            if (cb->state != TCP_CB_STATE_CLOSED) {
+                if (cb->state != TCP_CB_STATE_LISTEN) {
+                    tcp_tx(cb, cb->snd.nxt, 0, TCP_FLG_RST, NULL, 0);
+                }
+                tcp_child_unqueue(cb);
+                tcp_child_drop(cb);
+            }
+            pthread_mutex_unlock(&cb->mutex);
+            tcp_cb_put(cb);
+        }
+        pthread_mutex_lock(&lcb->mutex);
+    } while (more);
+}
+
+#define SIPROUND(v0, v1, v2, v3) \
+    do { \
+        v0 += v1; v1 = (v1 << 13) | (v1 >> 51); v1 ^= v0; v0 = (v0 << 32) | (v0 >> 32); \
+        v2 += v3; v3 = (v3 << 16) | (v3 >> 48); v3 ^= v2; \
+        v0 += v3; v3 = (v3 << 21) | (v3 >> 43); v3 ^= v0; \
+        v2 += v1; v1 = (v1 << 17) | (v1 >> 47); v1 ^= v2; v2 = (v2 << 32) | (v2 >> 32); \
+    } while (0)
+
+/* SipHash-2-4 of n whole 64-bit words */
+static uint64_t
+tcp_siphash (const uint64_t *key, const uint64_t *m, size_t n) {
+    uint64_t v0, v1, v2, v3, b;
+    size_t i;
+
+    v0 = key[0] ^ 0x736f6d6570736575ULL;
+    v1 = key[1] ^ 0x646f72616e646f6dULL;
+    v2 = key[0] ^ 0x6c7967656e657261ULL;
+    v3 = key[1] ^ 0x7465646279746573ULL;
+    for (i = 0; i < n; i++) {
+        v3 ^= m[i];
+        SIPROUND(v0, v1, v2, v3);
+        SIPROUND(v0, v1, v2, v3);
+        v0 ^= m[i];
+    }
+    b = (uint64_t)(n * 8) << 56;
+    v3 ^= b;
+    SIPROUND(v0, v1, v2, v3);
+    SIPROUND(v0, v1, v2, v3);
+    v0 ^= b;
+    v2 ^= 0xff;
+    SIPROUND(v0, v1, v2, v3);
+    SIPROUND(v0, v1, v2, v3);
+    SIPROUND(v0, v1, v2, v3);
+    SIPROUND(v0, v1, v2, v3);
+    return v0 ^ v1 ^ v2 ^ v3;
+}
+
+/* a MAC, so a peer cannot forge a cookie or alter the MSS index it carries */
+static uint32_t
+tcp_syncookie_hash (ip_addr_t addr, uint16_t port, uint16_t lport, uint32_t irs, uint32_t count, uint32_t idx) {
+    uint64_t m[3];
+
+    m[0] = (uint64_t)addr | ((uint64_t)port << 32) | ((uint64_t)lport << 48);
+    m[1] = (uint64_t)irs | ((uint64_t)count << 32);
+    m[2] = idx;
+    return (uint32_t)tcp_siphash(syncookie_key, m, 3);
+}
+
+static uint32_t
+tcp_syncookie_count (void) {
+    return (uint32_t)(tcp_clock() / 1000000 / TCP_SYNCOOKIE_PERIOD);
+}
+
+static uint32_t
+tcp_syncookie_make (ip_addr_t addr, uint16_t port, uint16_t lport, uint32_t irs, uint16_t mss) {
+    uint32_t count, idx;
+
+    count = tcp_syncookie_count();
+    for (idx = sizeof(tcp_syncookie_mss) / sizeof(*tcp_syncookie_mss) - 1; idx && tcp_syncookie_mss[idx] > mss; idx--);
+    return ((count & 0x1f) << 27) | (idx << 24) | (tcp_syncookie_hash(addr, port, lport, irs, count, idx) & 0xffffff);
+}
+
+/* returns the MSS encoded in a valid cookie, 0 otherwise */
+static uint16_t
+tcp_syncookie_check (ip_addr_t addr, uint16_t port, uint16_t lport, uint32_t irs, uint32_t cookie) {
+    uint32_t count;
+    int n;
+
+    count = tcp_syncookie_count();
+    for (n = 0; n < 2; n++, count--) {
+        if ((cookie >> 27) == (count & 0x1f) && (cookie & 0xffffff) == (tcp_syncookie_hash(addr, port, lport, irs, count, (cookie >> 24) & 0x07) & 0xffffff)) {
+            return tcp_syncookie_mss[(cookie >> 24) & 0x07];
+        }
+    }
+    return 0;
+}
+
+/*
+ * Answer a SYN with a SYN/ACK whose ISS is a cookie, keeping no state.
+ * Window scaling and SACK are offered only along with timestamps, which
+ * bring them back on the final ACK.
+ */
+static void
+tcp_syncookie_reply (struct netif *iface, ip_addr_t peer, struct tcp_hdr *syn, size_t hlen, size_t rcvbuf) {
+    struct tcp_options opts;
+    uint8_t opt[TCP_HDR_OPTIONS_SIZE_MAX];
+    size_t optlen = 0;
+    uint32_t val, iss;
+    uint16_t mss;
+
+    tcp_options_parse(syn, hlen, &opts);
+    mss = hton16(tcp_mss(iface));
+    opt[optlen++] = TCP_OPTION_MSS;
+    opt[optlen++] = TCP_OPTION_MSS_LEN;
+    memcpy(opt + optlen, &mss, sizeof(mss));
+    optlen += sizeof(mss);
+    if (opts.ts_ok) {
+        if (opts.wscale != -1) {
+            opt[optlen++] = TCP_OPTION_NOP;
+            opt[optlen++] = TCP_OPTION_WSCALE;
+            opt[optlen++] = TCP_OPTION_WSCALE_LEN;
+            opt[optlen++] = tcp_wscale(rcvbuf);
+        }
+        if (opts.sack_ok) {
+            opt[optlen++] = TCP_OPTION_NOP;
+            opt[optlen++] = TCP_OPTION_NOP;
+            opt[optlen++] = TCP_OPTION_SACK_PERMITTED;
+            opt[optlen++] = TCP_OPTION_SACK_PERMITTED_LEN;
+        }
+        opt[optlen++] = TCP_OPTION_NOP;
+        opt[optlen++] = TCP_OPTION_NOP;
+        opt[optlen++] = TCP_OPTION_TIMESTAMP;
+        opt[optlen++] = TCP_OPTION_TIMESTAMP_LEN;
+        val = ((uint32_t)(tcp_clock() / 1000) + syncookie_tsoff) & ~TCP_SYNCOOKIE_TS_MASK;
+        val |= opts.sack_ok ? TCP_SYNCOOKIE_TS_SACK : 0;
+        val |= opts.wscale != -1 ? (uint32_t)MIN(opts.wscale, TCP_WSCALE_MAX) : TCP_SYNCOOKIE_TS_NOWS;
+        val = hton32(val);
+        memcpy(opt + optlen, &val, sizeof(val));
+        optlen += sizeof(val);
+        val = hton32(opts.tsval);
+        memcpy(opt + optlen, &val, sizeof(val));
+        optlen += sizeof(val);
+    }
+    iss = tcp_syncookie_make(peer, syn->src, syn->dst, ntoh32(syn->seq), opts.mss ? opts.mss : TCP_DEFAULT_MSS);
+    tcp_tx_raw(iface, peer, syn->dst, syn->src, iss, ntoh32(syn->seq) + 1, TCP_FLG_SYN | TCP_FLG_ACK, hton16(MIN(rcvbuf, 0xffff)), opt, optlen);
+}
+
+/*
+ * Set up a fresh passive child from the final ACK of a handshake that
+ * was answered with a cookie, and queue it for tcp_api_accept().
+ */
+static int
+tcp_syncookie_open (struct tcp_cb *cb, struct tcp_hdr *hdr, struct tcp_options *opts) {
+    struct tcp_options syn;
+    uint32_t seq, ack, bits;
+
+    seq = ntoh32(hdr->seq);
+    ack = ntoh32(hdr->ack);
+    memset(&syn, 0, sizeof(syn));
+    syn.mss = tcp_syncookie_check(cb->peer.addr, hdr->src, hdr->dst, seq - 1, ack - 1);
+    if (!syn.mss) {
+        return -1;
+    }
+    if (opts->ts_ok) {
+        bits = opts->tsecr & TCP_SYNCOOKIE_TS_MASK;
+        if (bits & TCP_SYNCOOKIE_TS_SACK) {
+            cb->flags |= TCP_CB_FLG_SACK_OK;
+        }
+        if ((bits & 0x0f) != TCP_SYNCOOKIE_TS_NOWS) {
+            cb->flags |= TCP_CB_FLG_WSCALE;
+            cb->snd.wscale = bits & 0x0f;
+            cb->rcv.wscale = tcp_wscale(cb->rcvbuf.size);
+        }
+        cb->flags |= TCP_CB_FLG_TIMESTAMP;
+        cb->ts.offset = opts->tsecr - (uint32_t)(tcp_clock() / 1000);
+        cb->ts.recent = opts->tsval;
+        cb->ts.recent_stamp = tcp_clock();
+    }
+    tcp_set_mss(cb, &syn);
+    cb->irs = seq - 1;
+    cb->rcv.nxt = seq;
+    cb->rcv.adv = seq + MIN(cb->rcv.wnd, 0xffffU);
+    cb->ts.last_ack_sent = seq;
+    cb->iss = ack - 1;
+    cb->snd.una = ack;
+    cb->snd.nxt = ack;
+    cb->snd.max = ack;
+    cb->recover = ack;
+    cb->snd.wnd = tcp_snd_wnd(cb, hdr);
+    cb->snd.wl1 = seq;
+    cb->snd.wl2 = ack;
+    return tcp_child_establish(cb);
+}
+
+/*
+ * Rebuild and resend the SYN (or SYN/ACK). The acknowledgment is the
+ * current one, a stale one may get the segment dropped (RFC 5961).
+ */
+static void
+tcp_retransmit_syn (struct tcp_cb *cb) {
+    if (cb->state == TCP_CB_STATE_SYN_RCVD) {
+        tcp_tx(cb, cb->iss, cb->rcv.nxt, TCP_FLG_SYN | TCP_FLG_ACK, NULL, 0);
+    } else {
+        tcp_tx(cb, cb->iss, 0, TCP_FLG_SYN, NULL, 0);
+    }
+}
+
+/* the retransmission timer has expired, see RFC 6298 (5.4) - (5.6) */
+static void
+tcp_retransmit_timeout (struct tcp_cb *cb, uint64_t now) {
+    struct tcp_txq_entry *txq;
+
+    if (cb->snd.una == cb->snd.max) {
+        cb->rtx_expire = 0;
+        return;
+    }
+    /* duplicates of what is resent must not start fast retransmit (RFC 6582 4.2) */
+    cb->flags &= ~TCP_CB_FLG_RECOVERY;
+    cb->dupacks = 0;
+    cb->recover = cb->snd.max;
+    cb->tlp.expire = 0;
+    cb->tlp.sent = 0;
+    cb->rack.expire = 0;
+    if (cb->state == TCP_CB_STATE_SYN_RCVD && cb->parent && cb->retransmits >= TCP_SYNACK_RETRANSMIT_MAX) {
+        tcp_child_drop(cb);
+        return;
+    }
+    if (cb->retransmits >= TCP_RETRANSMIT_MAX) {
+        /* the peer is gone, give up the connection */
+        tcp_abort(cb);
+        return;
+    }
+    if (cb->state == TCP_CB_STATE_SYN_SENT || cb->state == TCP_CB_STATE_SYN_RCVD) {
+        tcp_retransmit_syn(cb);
+    } else {
+        if (!cb->retransmits) {
+            cb->cc.ops->on_rto(&cb->cc, cb->snd.max - cb->snd.una);
+        } else {
+            /* the peer may have dropped what it SACKed (RFC 2018 8) */
+            tcp_range_clear(&cb->sack, &cb->nsack);
+            cb->sacked = 0;
+            cb->sack_high = cb->snd.una;
+            for (txq = cb->txq.head; txq; txq = txq->next) {
+                txq->flags &= ~TCP_TXQ_FLG_SACKED;
+            }
+        }
+        /* go back to snd.una and resend as the congestion window allows (RFC 5681 3.1) */
+        for (txq = cb->txq.head; txq; txq = txq->next) {
+            txq->flags = (txq->flags | TCP_TXQ_FLG_RETRANSMITTED) & ~TCP_TXQ_FLG_LOST;
+        }
+        cb->snd.nxt = cb->snd.una;
+        tcp_output(cb);
+    }
+    cb->retransmits++;
+    cb->rtx_expire = now + tcp_rto_backoff(cb);
+}
+
+/*
+ * The probe timeout has expired (RFC 8985 7.3). New data is sent if the
+ * peer's window allows, otherwise the last segment again, so that a tail
+ * loss is reported by the ACK it elicits rather than found by the RTO.
+ */
+static void
+tcp_tlp_timeout (struct tcp_cb *cb, uint64_t now) {
+    uint32_t off, end, len;
+    uint8_t flg;
+
+    cb->tlp.expire = 0;
+    if (cb->snd.una == cb->snd.max || (cb->flags & TCP_CB_FLG_RECOVERY) || cb->tlp.sent) {
+        return;
+    }
+    off = cb->snd.nxt - cb->snd.una;
+    if (off < cb->sndbuf.len && cb->snd.wnd > off) {
+        len = MIN(MIN(cb->sndbuf.len - off, (size_t)cb->mss), (size_t)(cb->snd.wnd - off));
+        flg = TCP_FLG_ACK | (off + len == cb->sndbuf.len ? TCP_FLG_PSH : 0);
+        if (tcp_output_segment(cb, off, len, flg) == -1) {
+            return;
+        }
+        cb->snd.nxt += len;
+        cb->tlp.retrans = 0;
+    } else {
+        /* a lone FIN is left to the retransmission timer */
+        end = MIN(off, (uint32_t)cb->sndbuf.len);
+        len = MIN(end, (uint32_t)cb->mss);
+        if (!len) {
+            return;
+        }
+        tcp_retransmit(cb, cb->snd.una + end - len, len);
+        cb->tlp.retrans = 1;
+    }
+    cb->tlp.sent = 1;
+    cb->tlp.end = cb->snd.max;
+    cb->rtx_expire = now + tcp_rto_backoff(cb);
+}
+
+/*
+ * Probe the closed window with an old sequence number, which the peer
+ * must answer with an ACK carrying its current window.
+ */
+static void
+tcp_persist_timeout (struct tcp_cb *cb, uint64_t now) {
+    cb->persist.expire = 0;
+    if (!TCP_CB_STATE_SND_ISREADY(cb)) {
+        return;
     }
-    txq->segment = malloc(len);
-    if (!txq->segment) {
-        free(txq);
-        return -1;
+    tcp_tx(cb, cb->snd.una - 1, cb->rcv.nxt, TCP_FLG_ACK, NULL, 0);
+    if (cb->persist.probes < 255) {
+        cb->persist.probes++;
     }
-    memcpy(txq->segment, hdr, len);
-    txq->len = len;
-    gettimeofday(&txq->timestamp, NULL);
-    txq->next = NULL;
+    tcp_persist_arm(cb, now);
+}
 
-    // set txq to next of tail entry
-    if (cb->txq.head == NULL) {
-        cb->txq.head = txq;
-    } else {
-        cb->txq.tail->next = txq;
+/* the reordering window of a segment has passed, see RFC 8985 6.3 */
+static void
+tcp_rack_timeout (struct tcp_cb *cb, uint64_t now) {
+    if (!tcp_rack_detect(cb, now)) {
+        return;
     }
-    // update tail entry
-    cb->txq.tail = txq;
-
-    return 0;
+    if (!(cb->flags & TCP_CB_FLG_RECOVERY) && TCP_SEQ_GT(cb->snd.una, cb->recover)) {
+        tcp_enter_recovery(cb);
+    }
+    tcp_output(cb);
 }
 
-static ssize_t
-tcp_tx (struct tcp_cb *cb, uint32_t seq, uint32_t ack, uint8_t flg, uint8_t *buf, size_t len) {
-    uint8_t segment[1500];
-    struct tcp_hdr *hdr;
-    ip_addr_t self, peer;
-    uint32_t pseudo = 0;
+/*
+ * Enter TIME_WAIT. The connection is handed over to a tcp_tw entry, the
+ * TCB leaves the lookup tables in CLOSED and goes when tcp_api_close()
+ * returns. Without memory for the entry the TCB itself stays in TIME_WAIT
+ * until its own timer expires. Either way its buffers are freed now.
+ */
+static void
+tcp_time_wait (struct tcp_cb *cb) {
+    struct tcp_tw *tw;
 
-    memset(&segment, 0, sizeof(segment));
-    hdr = (struct tcp_hdr *)segment;
-    hdr->src = cb->port;
-    hdr->dst = cb->peer.port;
-    hdr->seq = hton32(seq);
-    hdr->ack = hton32(ack);
-    hdr->off = (sizeof(struct tcp_hdr) >> 2) << 4;
-    hdr->flg = flg;
-    hdr->win = hton16(cb->rcv.wnd);
-    hdr->sum = 0;
-    hdr->urg = 0;
-    memcpy(hdr + 1, buf, len);
-    self = ((struct netif_ip *)cb->iface)->unicast;
-    peer = cb->peer.addr;
-    pseudo += (self >> 16) & 0xffff;
-    pseudo += self & 0xffff;
-    pseudo += (peer >> 16) & 0xffff;
-    pseudo += peer & 0xffff;
-    pseudo += hton16((uint16_t)IP_PROTOCOL_TCP);
-    pseudo += hton16(sizeof(struct tcp_hdr) + len);
-    hdr->sum = cksum16((uint16_t *)hdr, sizeof(struct tcp_hdr) + len, pseudo);
-    ip_tx(cb->iface, IP_PROTOCOL_TCP, (uint8_t *)hdr, sizeof(struct tcp_hdr) + len, &peer);
-    tcp_txq_add(cb, hdr, sizeof(struct tcp_hdr) + len);
-    return len;
+    cb->state = TCP_CB_STATE_TIME_WAIT;
+    cb->rtx_expire = 0;
+    cb->delack.expire = 0;
+    cb->persist.expire = 0;
+    cb->rack.expire = 0;
+    cb->tlp.expire = 0;
+    tcp_cb_release(cb);
+    tw = malloc(sizeof(struct tcp_tw));
+    if (!tw) {
+        fprintf(stderr, "tcp: no memory for a TIME_WAIT entry, the TCB is kept\n");
+        cb->tw_expire = tcp_clock() + TCP_TIME_WAIT_TIMEOUT;
+        tcp_timer_arm(cb, cb->tw_expire);
+        pthread_cond_broadcast(&cb->cond);
+        return;
+    }
+    tw->iface = cb->iface;
+    tw->addr = cb->peer.addr;
+    tw->port = cb->peer.port;
+    tw->lport = cb->port;
+    tw->snd_nxt = cb->snd.nxt;
+    tw->rcv_nxt = cb->rcv.nxt;
+    tw->win = tcp_win_field(cb, TCP_FLG_ACK);
+    tw->ts = (cb->flags & TCP_CB_FLG_TIMESTAMP) ? 1 : 0;
+    tw->ts_offset = cb->ts.offset;
+    tw->ts_recent = cb->ts.recent;
+    tw->expire = tcp_clock() + TCP_TIME_WAIT_TIMEOUT;
+    cb->state = TCP_CB_STATE_CLOSED;
+    pthread_rwlock_wrlock(&table_lock);
+    tcp_conn_hash_del(cb);
+    tcp_tw_add(tw);
+    pthread_rwlock_unlock(&table_lock);
+    pthread_cond_broadcast(&cb->cond);
+}
+
+/* 2MSL have passed for a TCB kept in TIME_WAIT, it goes unless tcp_api_close() has yet to return */
+static void
+tcp_time_wait_timeout (struct tcp_cb *cb) {
+    cb->tw_expire = 0;
+    cb->state = TCP_CB_STATE_CLOSED;
+    pthread_cond_broadcast(&cb->cond);
+    pthread_rwlock_wrlock(&table_lock);
+    if (cb->desc != -1) {
+        pthread_rwlock_unlock(&table_lock);
+        return;
+    }
+    tcp_cb_unlink(cb);
+    pthread_rwlock_unlock(&table_lock);
+    tcp_cb_put(cb);
 }
 
+/*
+ * Sleep until the earliest deadline in the timer heap or of the TIME_WAIT
+ * entries, then run the timers that are due on that TCB and queue it
+ * again by its next one, or let the expired TIME_WAIT entries go.
+ */
 static void *
 tcp_timer_thread (void *arg) {
-    struct timeval timestamp;
     struct tcp_cb *cb;
-    struct tcp_txq_entry *txq, *prev, *tmp;
-    ip_addr_t peer;
+    struct timespec ts;
+    uint64_t now, next;
 
     while (1) {
-        gettimeofday(&timestamp, NULL);
-        pthread_mutex_lock(&mutex);
-        for (cb = cb_table; cb < array_tailof(cb_table); cb++) {
-            prev = NULL;
-            txq = cb->txq.head;
-            while (txq) {
-                if (ntoh32(txq->segment->seq) >= cb->snd.una) {
-                    if (timestamp.tv_sec - txq->timestamp.tv_sec > 3) {
-                        peer = cb->peer.addr;
-                        ip_tx(cb->iface, IP_PROTOCOL_TCP, (uint8_t *)txq->segment, txq->len, &peer);
-                        txq->timestamp = timestamp;
-                    }
-
-                    // update previous tcp_txq_entry
-                    prev = txq;
-                    txq = txq->next;
-                } else {
-                    // remove tcp_txq_entry from list
-                    // do not change prev, just update txq by txq->next,
-                    // and free txq and txq->segment,
-                    // and update cb->txq.[head|tail] if needed
-
-                    // swap tail tcp_txq_entry
-                    if (!txq->next) {
-                        // txq is tail entry
-                        cb->txq.tail = prev;
-                    }
-                    // swap previous tcp_txq_entry
-                    if (prev) {
-                        prev->next = txq->next;
-                    } else {
-                        cb->txq.head = txq->next;
-                    }
-
-                    // free tcp_txq_entry
-                    tmp = txq->next;
-                    free(txq->segment);
-                    free(txq);
-                    // check next entry
-                    txq = tmp;
-                }
+        pthread_mutex_lock(&timer_lock);
+        while (1) {
+            now = tcp_clock();
+            next = tcp_timer_min(timer_heap_num ? timer_heap[0]->timer.expire : 0, tw_expire);
+            if (next && next <= now) {
+                break;
+            }
+            if (!next) {
+                pthread_cond_wait(&timer_cond, &timer_lock);
+                continue;
+            }
+            ts.tv_sec = next / 1000000;
+            ts.tv_nsec = (next % 1000000) * 1000;
+            pthread_cond_timedwait(&timer_cond, &timer_lock, &ts);
+        }
+        if (tw_expire && tw_expire <= now) {
+            pthread_mutex_unlock(&timer_lock);
+            tcp_tw_reap(now);
+            continue;
+        }
+        cb = timer_heap[0];
+        tcp_timer_heap_del(cb);
+        pthread_mutex_unlock(&timer_lock);
+        pthread_mutex_lock(&cb->mutex);
+        if (cb->state != TCP_CB_STATE_CLOSED) {
+            if (cb->delack.expire && cb->delack.expire <= now) {
+                cb->delack.expire = 0;
+                tcp_tx(cb, cb->snd.nxt, cb->rcv.nxt, TCP_FLG_ACK, NULL, 0);
+            }
+            if (cb->rack.expire && cb->rack.expire <= now) {
+                tcp_rack_timeout(cb, now);
+            }
+            if (cb->persist.expire && cb->persist.expire <= now) {
+                tcp_persist_timeout(cb, now);
             }
+            if (cb->tlp.expire && cb->tlp.expire <= now) {
+                tcp_tlp_timeout(cb, now);
+            }
+            if (cb->rtx_expire && cb->rtx_expire <= now) {
+                tcp_retransmit_timeout(cb, now);
+            }
+            if (cb->tw_expire && cb->tw_expire <= now) {
+                tcp_time_wait_timeout(cb);
+            }
+        }
+        if (cb->state != TCP_CB_STATE_CLOSED) {
+            tcp_timer_arm(cb, tcp_timer_next(cb));
         }
-        pthread_mutex_unlock(&mutex);
-        usleep(100000);
+        pthread_mutex_unlock(&cb->mutex);
+        tcp_cb_put(cb);
     }
     return NULL;
 }
 
+/*
+ * A segment for a connection in TIME_WAIT. Returns 1 when it is to be
+ * acknowledged with reply, filled from the entry, and -1 when it is a
+ * SYN that may open a new incarnation (RFC 9293 3.10.7.4, RFC 6191), in
+ * which case the entry is gone.
+ * NOTE: must be called with table_lock held for writing
+ */
+static int
+tcp_tw_input (struct tcp_tw *tw, struct tcp_hdr *hdr, size_t hlen, size_t plen, struct tcp_tw *reply) {
+    struct tcp_options opts;
+    uint32_t seq;
+    int head;
+
+    seq = ntoh32(hdr->seq);
+    if (TCP_FLG_ISSET(hdr->flg, TCP_FLG_RST)) {
+        /* ignored, see RFC 1337 */
+        return 0;
+    }
+    if (TCP_FLG_IS(hdr->flg, TCP_FLG_SYN) && TCP_SEQ_GT(seq, tw->rcv_nxt)) {
+        tcp_tw_del(tw);
+        return -1;
+    }
+    if (TCP_FLG_ISSET(hdr->flg, TCP_FLG_FIN)) {
+        /* the peer missed our ACK of its FIN, wait 2MSL from now */
+        tcp_options_parse(hdr, hlen, &opts);
+        if (tw->ts && opts.ts_ok) {
+            tw->ts_recent = opts.tsval;
+        }
+        tw->expire = tcp_clock() + TCP_TIME_WAIT_TIMEOUT;
+        head = tw == tw_head;
+        tcp_tw_unlink(tw);
+        tcp_tw_append(tw);
+        if (head) {
+            tcp_tw_update();
+        }
+    } else if (!plen && seq == tw->rcv_nxt && !TCP_FLG_ISSET(hdr->flg, TCP_FLG_SYN)) {
+        return 0;
+    }
+    *reply = *tw;
+    return 1;
+}
+
+static void
+tcp_tw_ack (struct tcp_tw *tw) {
+    uint8_t opt[TCP_OPTION_TIMESTAMP_SPACE];
+    size_t optlen = 0;
+    uint32_t val;
+
+    if (tw->ts) {
+        opt[optlen++] = TCP_OPTION_NOP;
+        opt[optlen++] = TCP_OPTION_NOP;
+        opt[optlen++] = TCP_OPTION_TIMESTAMP;
+        opt[optlen++] = TCP_OPTION_TIMESTAMP_LEN;
+        val = hton32((uint32_t)(tcp_clock() / 1000) + tw->ts_offset);
+        memcpy(opt + optlen, &val, sizeof(val));
+        optlen += sizeof(val);
+        val = hton32(tw->ts_recent);
+        memcpy(opt + optlen, &val, sizeof(val));
+        optlen += sizeof(val);
+    }
+    tcp_tx_raw(tw->iface, tw->addr, tw->lport, tw->port, tw->snd_nxt, tw->rcv_nxt, TCP_FLG_ACK, tw->win, opt, optlen);
+}
+
+
 static void
 tcp_incoming_event (struct tcp_cb *cb, struct tcp_hdr *hdr, size_t len) {
     uint32_t seq, ack;
     size_t hlen, plen;
+    struct tcp_options opts;
+    int fin, gap, ts;
 
     hlen = ((hdr->off >> 4) << 2);
     plen = len - hlen;
+    tcp_options_parse(hdr, hlen, &opts);
     switch (cb->state) {
         case TCP_CB_STATE_CLOSED:
             if (TCP_FLG_ISSET(hdr->flg, TCP_FLG_RST)) {
@@ -255,6 +2833,15 @@ tcp_incoming_event (struct tcp_cb *cb, struct tcp_hdr *hdr, size_t len) {
             if (TCP_FLG_ISSET(hdr->flg, TCP_FLG_RST)) {
                 return;
             }
+            if (TCP_FLG_ISSET(hdr->flg, TCP_FLG_ACK) && !TCP_FLG_ISSET(hdr->flg, TCP_FLG_SYN) && !(cb->flags & TCP_CB_FLG_SYNQ)) {
+                /* the child was made for a valid cookie, the rest of the segment is processed as established */
+                if (tcp_syncookie_open(cb, hdr, &opts) == -1) {
+                    tcp_tx(cb, ntoh32(hdr->ack), 0, TCP_FLG_RST, NULL, 0);
+                    tcp_child_drop(cb);
+                    return;
+                }
+                break;
+            }
             if (TCP_FLG_ISSET(hdr->flg, TCP_FLG_ACK)) {
                 seq = ntoh32(hdr->ack);
                 ack = 0;
@@ -262,14 +2849,37 @@ tcp_incoming_event (struct tcp_cb *cb, struct tcp_hdr *hdr, size_t len) {
                 return;
             }
             if (TCP_FLG_ISSET(hdr->flg, TCP_FLG_SYN)) {
+                if (opts.sack_ok) {
+                    cb->flags |= TCP_CB_FLG_SACK_OK;
+                }
+                if (opts.wscale != -1) {
+                    cb->flags |= TCP_CB_FLG_WSCALE;
+                    cb->snd.wscale = MIN(opts.wscale, TCP_WSCALE_MAX);
+                    cb->rcv.wscale = tcp_wscale(cb->rcvbuf.size);
+                }
+                if (opts.ts_ok) {
+                    cb->flags |= TCP_CB_FLG_TIMESTAMP;
+                    cb->ts.offset = (uint32_t)random();
+                    cb->ts.recent = opts.tsval;
+                    cb->ts.recent_stamp = tcp_clock();
+                }
+                tcp_set_mss(cb, &opts);
                 cb->rcv.nxt = ntoh32(hdr->seq) + 1;
                 cb->irs = ntoh32(hdr->seq);
                 cb->iss = (uint32_t)random();
+                cb->snd.max = cb->iss;
+                cb->recover = cb->iss;
                 seq = cb->iss;
                 ack = cb->rcv.nxt;
-                tcp_tx(cb, seq, ack, TCP_FLG_SYN | TCP_FLG_ACK, NULL, 0);
+                if (tcp_tx(cb, seq, ack, TCP_FLG_SYN | TCP_FLG_ACK, NULL, 0) == -1) {
+                    tcp_child_drop(cb);
+                    return;
+                }
                 cb->snd.nxt = cb->iss + 1;
                 cb->snd.una = cb->iss;
+                cb->snd.wnd = ntoh16(hdr->win);
+                cb->snd.wl1 = ntoh32(hdr->seq);
+                cb->snd.wl2 = cb->iss;
                 cb->state = TCP_CB_STATE_SYN_RCVD;
             }
             return;
@@ -286,7 +2896,8 @@ tcp_incoming_event (struct tcp_cb *cb, struct tcp_hdr *hdr, size_t len) {
             }
             if (TCP_FLG_ISSET(hdr->flg, TCP_FLG_RST)) {
                 if (TCP_FLG_ISSET(hdr->flg, TCP_FLG_ACK)) {
-                    // TCB close
+                    /* connection refused */
+                    tcp_abort(cb);
                 }
                 return;
             }
@@ -294,14 +2905,31 @@ tcp_incoming_event (struct tcp_cb *cb, struct tcp_hdr *hdr, size_t len) {
                 cb->rcv.nxt = ntoh32(hdr->seq) + 1;
                 cb->irs = ntoh32(hdr->seq);
                 if (TCP_FLG_ISSET(hdr->flg, TCP_FLG_ACK)) {
-                    cb->snd.una = ntoh32(hdr->ack);
-                    // delete TX queue
-                    if (cb->snd.una > cb->iss) {
+                    cb->snd.wl1 = ntoh32(hdr->seq);
+                    cb->snd.wl2 = ntoh32(hdr->ack);
+                    tcp_ack(cb, hdr, plen, &opts);
+                    if (TCP_SEQ_GT(cb->snd.una, cb->iss)) {
+                        if (opts.sack_ok) {
+                            cb->flags |= TCP_CB_FLG_SACK_OK;
+                        }
+                        if (opts.wscale != -1) {
+                            cb->flags |= TCP_CB_FLG_WSCALE;
+                            cb->snd.wscale = MIN(opts.wscale, TCP_WSCALE_MAX);
+                        } else {
+                            /* both sides scale or neither does */
+                            cb->rcv.wscale = 0;
+                        }
+                        if (opts.ts_ok) {
+                            cb->flags |= TCP_CB_FLG_TIMESTAMP;
+                            cb->ts.recent = opts.tsval;
+                            cb->ts.recent_stamp = tcp_clock();
+                        }
+                        tcp_set_mss(cb, &opts);
                         cb->state = TCP_CB_STATE_ESTABLISHED;
                         seq = cb->snd.nxt;
                         ack = cb->rcv.nxt;
                         tcp_tx(cb, seq, ack, TCP_FLG_ACK, NULL, 0);
-                        pthread_cond_signal(&cb->cond);
+                        pthread_cond_broadcast(&cb->cond);
                     }
                     return;
                 }
@@ -313,24 +2941,57 @@ tcp_incoming_event (struct tcp_cb *cb, struct tcp_hdr *hdr, size_t len) {
         default:
             break;
     }
-    if (ntoh32(hdr->seq) != cb->rcv.nxt) {
-        // TODO
+    ts = (cb->flags & TCP_CB_FLG_TIMESTAMP) && opts.ts_ok;
+    if ((ts && !TCP_FLG_ISSET(hdr->flg, TCP_FLG_RST) && tcp_paws_reject(cb, &opts)) || !tcp_seq_acceptable(cb, ntoh32(hdr->seq), plen + (TCP_FLG_ISSET(hdr->flg, TCP_FLG_FIN) ? 1 : 0))) {
+        if (!TCP_FLG_ISSET(hdr->flg, TCP_FLG_RST)) {
+            tcp_tx(cb, cb->snd.nxt, cb->rcv.nxt, TCP_FLG_ACK, NULL, 0);
+        }
+        if (cb->state == TCP_CB_STATE_TIME_WAIT && TCP_FLG_ISSET(hdr->flg, TCP_FLG_FIN)) {
+            /* the peer missed our ACK of its FIN */
+            cb->tw_expire = tcp_clock() + TCP_TIME_WAIT_TIMEOUT;
+            tcp_timer_arm(cb, cb->tw_expire);
+        }
+        return;
+    }
+    if (ts && TCP_SEQ_LEQ(ntoh32(hdr->seq), cb->ts.last_ack_sent)) {
+        /* RFC 7323 4.3 */
+        cb->ts.recent = opts.tsval;
+        cb->ts.recent_stamp = tcp_clock();
+    }
+    if (TCP_FLG_ISSET(hdr->flg, TCP_FLG_RST)) {
+        if (cb->state == TCP_CB_STATE_TIME_WAIT) {
+            /* ignored, see RFC 1337 */
+            return;
+        }
+        if (ntoh32(hdr->seq) != cb->rcv.nxt) {
+            /* in the window but not exactly next, a challenge ACK lets a genuine peer send it again (RFC 5961 3.2) */
+            tcp_tx(cb, cb->snd.nxt, cb->rcv.nxt, TCP_FLG_ACK, NULL, 0);
+            return;
+        }
+        /* a passive open returns to LISTEN, any other connection is reset (RFC 9293 3.10.7.4) */
+        tcp_abort(cb);
         return;
     }
-    if (TCP_FLG_ISSET(hdr->flg, TCP_FLG_RST | TCP_FLG_SYN)) {
-        // TODO
+    if (TCP_FLG_ISSET(hdr->flg, TCP_FLG_SYN)) {
+        /* a challenge ACK, see RFC 5961 4.2 */
+        tcp_tx(cb, cb->snd.nxt, cb->rcv.nxt, TCP_FLG_ACK, NULL, 0);
         return;
     }
     if (!TCP_FLG_ISSET(hdr->flg, TCP_FLG_ACK)) {
-        // TODO
+        /* dropped, see RFC 9293 3.10.7.4 */
         return;
     }
     switch (cb->state) {
         case TCP_CB_STATE_SYN_RCVD:
-            if (cb->snd.una <= ntoh32(hdr->ack) && ntoh32(hdr->ack) <= cb->snd.nxt) {
-                cb->state = TCP_CB_STATE_ESTABLISHED;
-                queue_push(&cb->parent->backlog, cb, sizeof(*cb));
-                pthread_cond_signal(&cb->parent->cond);
+            if (TCP_SEQ_LT(cb->snd.una, ntoh32(hdr->ack)) && TCP_SEQ_LEQ(ntoh32(hdr->ack), cb->snd.max)) {
+                if (!cb->parent) {
+                    cb->state = TCP_CB_STATE_ESTABLISHED;
+                } else if (tcp_child_establish(cb) == -1) {
+                    /* no room for the child, let the peer fail at once */
+                    tcp_tx(cb, ntoh32(hdr->ack), 0, TCP_FLG_RST, NULL, 0);
+                    tcp_child_drop(cb);
+                    return;
+                }
             } else {
                 tcp_tx(cb, ntoh32(hdr->ack), 0, TCP_FLG_RST, NULL, 0);
                 break;
@@ -340,62 +3001,73 @@ tcp_incoming_event (struct tcp_cb *cb, struct tcp_hdr *hdr, size_t len) {
         case TCP_CB_STATE_FIN_WAIT2:
         case TCP_CB_STATE_CLOSE_WAIT:
         case TCP_CB_STATE_CLOSING:
-            if (cb->snd.una < ntoh32(hdr->ack) && ntoh32(hdr->ack) <= cb->snd.nxt) {
-                cb->snd.una = ntoh32(hdr->ack);
-            } else if (ntoh32(hdr->ack) > cb->snd.nxt) {
+            if (TCP_SEQ_GT(ntoh32(hdr->ack), cb->snd.max)) {
                 tcp_tx(cb, cb->snd.nxt, cb->rcv.nxt, TCP_FLG_ACK, NULL, 0);
                 return;
             }
-            // send window update
+            if (TCP_SEQ_GEQ(ntoh32(hdr->ack), cb->snd.una)) {
+                tcp_ack(cb, hdr, plen, &opts);
+            }
             if (cb->state == TCP_CB_STATE_FIN_WAIT1) {
-                if (ntoh32(hdr->ack) == cb->snd.nxt) {
+                if ((cb->flags & TCP_CB_FLG_FIN_SENT) && ntoh32(hdr->ack) == cb->snd.max) {
                     cb->state = TCP_CB_STATE_FIN_WAIT2;
                 }
             } else if (cb->state == TCP_CB_STATE_CLOSING) {
-                if (ntoh32(hdr->ack) == cb->snd.nxt) {
-                    cb->state = TCP_CB_STATE_TIME_WAIT;
-                    pthread_cond_signal(&cb->cond);
+                if ((cb->flags & TCP_CB_FLG_FIN_SENT) && ntoh32(hdr->ack) == cb->snd.max) {
+                    tcp_time_wait(cb);
                 }
                 return;
             }
+            tcp_output(cb);
             break;
         case TCP_CB_STATE_LAST_ACK:
-            cb->state = TCP_CB_STATE_CLOSED;
-            pthread_cond_signal(&cb->cond);
+            if (TCP_SEQ_GEQ(ntoh32(hdr->ack), cb->snd.una) && TCP_SEQ_LEQ(ntoh32(hdr->ack), cb->snd.max)) {
+                tcp_ack(cb, hdr, plen, &opts);
+            }
+            if ((cb->flags & TCP_CB_FLG_FIN_SENT) && ntoh32(hdr->ack) == cb->snd.max) {
+                cb->state = TCP_CB_STATE_CLOSED;
+                pthread_cond_broadcast(&cb->cond);
+            } else {
+                tcp_output(cb);
+            }
             return;
     }
-    if (plen) {
-        switch (cb->state) {
-            case TCP_CB_STATE_ESTABLISHED:
-            case TCP_CB_STATE_FIN_WAIT1:
-            case TCP_CB_STATE_FIN_WAIT2:
-                memcpy(cb->window + (sizeof(cb->window) - cb->rcv.wnd), (uint8_t *)hdr + hlen, plen);
-                cb->rcv.nxt = ntoh32(hdr->seq) + plen;
-                cb->rcv.wnd -= plen;
-                seq = cb->snd.nxt;
-                ack = cb->rcv.nxt;
-                tcp_tx(cb, seq, ack, TCP_FLG_ACK, NULL, 0);
-                pthread_cond_signal(&cb->cond);
-                break;
-            default:
+    fin = 0;
+    switch (cb->state) {
+        case TCP_CB_STATE_ESTABLISHED:
+        case TCP_CB_STATE_FIN_WAIT1:
+        case TCP_CB_STATE_FIN_WAIT2:
+            if (!plen && !TCP_FLG_ISSET(hdr->flg, TCP_FLG_FIN)) {
                 break;
-        }
+            }
+            seq = cb->rcv.nxt;
+            gap = cb->ooo != NULL;
+            fin = tcp_rcv_data(cb, ntoh32(hdr->seq), (uint8_t *)hdr + hlen, plen, TCP_FLG_ISSET(hdr->flg, TCP_FLG_FIN));
+            if (cb->rcv.nxt != seq) {
+                pthread_cond_broadcast(&cb->cond);
+            }
+            if (!fin) {
+                /* in-sequence data, or a duplicate ACK for the gap */
+                tcp_delack(cb, plen, gap || ntoh32(hdr->seq) != seq);
+            }
+            break;
+        default:
+            break;
     }
-    if (TCP_FLG_ISSET(hdr->flg, TCP_FLG_FIN)) {
+    if (fin) {
         cb->rcv.nxt++;
         tcp_tx(cb, cb->snd.nxt, cb->rcv.nxt, TCP_FLG_ACK, NULL, 0);
         switch (cb->state) {
             case TCP_CB_STATE_SYN_RCVD:
             case TCP_CB_STATE_ESTABLISHED:
                 cb->state = TCP_CB_STATE_CLOSE_WAIT;
-                pthread_cond_signal(&cb->cond);
+                pthread_cond_broadcast(&cb->cond);
                 break;
             case TCP_CB_STATE_FIN_WAIT1:
-                cb->state = TCP_CB_STATE_FIN_WAIT2;
+                cb->state = TCP_CB_STATE_CLOSING;
                 break;
             case TCP_CB_STATE_FIN_WAIT2:
-                cb->state = TCP_CB_STATE_TIME_WAIT;
-                pthread_cond_signal(&cb->cond);
+                tcp_time_wait(cb);
                 break;
             default:
                 break;
@@ -405,11 +3077,132 @@ tcp_incoming_event (struct tcp_cb *cb, struct tcp_hdr *hdr, size_t len) {
     return;
 }
 
+/* refuse a segment that belongs to no connection (RFC 9293 3.10.7.1) */
+static void
+tcp_reset_raw (struct netif *iface, ip_addr_t peer, struct tcp_hdr *hdr, size_t plen) {
+    uint32_t ack;
+
+    if (TCP_FLG_ISSET(hdr->flg, TCP_FLG_RST)) {
+        return;
+    }
+    if (TCP_FLG_ISSET(hdr->flg, TCP_FLG_ACK)) {
+        tcp_tx_raw(iface, peer, hdr->dst, hdr->src, ntoh32(hdr->ack), 0, TCP_FLG_RST, 0, NULL, 0);
+        return;
+    }
+    ack = ntoh32(hdr->seq) + plen;
+    if (TCP_FLG_ISSET(hdr->flg, TCP_FLG_SYN)) {
+        ack++;
+    }
+    if (TCP_FLG_ISSET(hdr->flg, TCP_FLG_FIN)) {
+        ack++;
+    }
+    tcp_tx_raw(iface, peer, hdr->dst, hdr->src, 0, ack, TCP_FLG_RST | TCP_FLG_ACK, 0, NULL, 0);
+}
+
+/*
+ * A segment that matches no connection is answered by a TIME_WAIT entry,
+ * opens a child of the listener lcb (NULL if there is none) or is refused.
+ * Returns the child, referenced, to process the segment on.
+ */
+static struct tcp_cb *
+tcp_rx_passive (struct tcp_hdr *hdr, size_t len, ip_addr_t src, struct netif *iface, struct tcp_cb *lcb) {
+    size_t hlen, rcvbuf, sndbuf;
+    struct tcp_cb *cb;
+    struct tcp_tw *tw, reply;
+    struct tcp_cc_ops *ops;
+    uint16_t flags = 0;
+    int listen = 0, synq = 0, ret;
+
+    hlen = (hdr->off >> 4) << 2;
+    if (lcb) {
+        /* what the child takes over from the listener, and its place in the half-open queue */
+        pthread_mutex_lock(&lcb->mutex);
+        if (lcb->state == TCP_CB_STATE_LISTEN) {
+            listen = 1;
+            flags = lcb->flags;
+            rcvbuf = lcb->rcvbuf.size;
+            sndbuf = lcb->sndbuf.size;
+            ops = lcb->cc.ops;
+            if (TCP_FLG_IS(hdr->flg, TCP_FLG_SYN) && lcb->nsynq + (int)lcb->overflow.num < lcb->synq_max) {
+                lcb->nsynq++;
+                synq = 1;
+            }
+        }
+        pthread_mutex_unlock(&lcb->mutex);
+    }
+    pthread_rwlock_wrlock(&table_lock);
+    /* look up again, the same SYN may have been handled meanwhile */
+    cb = tcp_conn_lookup(iface, src, hdr->src, hdr->dst);
+    if (!cb && (tw = tcp_tw_lookup(iface, src, hdr->src, hdr->dst))) {
+        ret = tcp_tw_input(tw, hdr, hlen, len - hlen, &reply);
+        if (ret != -1) {
+            pthread_rwlock_unlock(&table_lock);
+            if (ret) {
+                tcp_tw_ack(&reply);
+            }
+            goto RELEASE;
+        }
+    }
+    if (!cb) {
+        if (!listen || TCP_FLG_ISSET(hdr->flg, TCP_FLG_RST)) {
+            pthread_rwlock_unlock(&table_lock);
+            tcp_reset_raw(iface, src, hdr, len - hlen);
+            goto RELEASE;
+        }
+        if (TCP_FLG_IS(hdr->flg, TCP_FLG_SYN) && !synq) {
+            /* the half-open queue is full */
+            pthread_rwlock_unlock(&table_lock);
+            if (flags & TCP_CB_FLG_SYNCOOKIES) {
+                tcp_syncookie_reply(iface, src, hdr, hlen, rcvbuf);
+            }
+            goto RELEASE;
+        }
+        if (!TCP_FLG_IS(hdr->flg, TCP_FLG_SYN) && (!TCP_FLG_ISSET(hdr->flg, TCP_FLG_ACK) || TCP_FLG_ISSET(hdr->flg, TCP_FLG_SYN) || !(flags & TCP_CB_FLG_SYNCOOKIES) || !tcp_syncookie_check(src, hdr->src, hdr->dst, ntoh32(hdr->seq) - 1, ntoh32(hdr->ack) - 1))) {
+            /* an ACK at a listener, only the final one of a cookie handshake is taken */
+            pthread_rwlock_unlock(&table_lock);
+            tcp_reset_raw(iface, src, hdr, len - hlen);
+            goto RELEASE;
+        }
+        cb = tcp_cb_alloc();
+        if (!cb) {
+            pthread_rwlock_unlock(&table_lock);
+            goto RELEASE;
+        }
+        cb->state = TCP_CB_STATE_LISTEN;
+        cb->iface = iface;
+        cb->port = lcb->port;
+        cb->peer.addr = src;
+        cb->peer.port = hdr->src;
+        cb->rcvbuf.size = rcvbuf;
+        cb->rcv.wnd = cb->rcvbuf.size;
+        cb->sndbuf.size = sndbuf;
+        cb->cc.ops = ops;
+        cb->flags = flags & (TCP_CB_FLG_RACK | TCP_CB_FLG_NODELAY | TCP_CB_FLG_CORK);
+        cb->parent = tcp_cb_get(lcb);
+        if (synq) {
+            /* the place taken above is the child's now */
+            cb->flags |= TCP_CB_FLG_SYNQ;
+            synq = 0;
+        }
+        tcp_conn_hash_add(cb);
+    }
+    tcp_cb_get(cb);
+    pthread_rwlock_unlock(&table_lock);
+RELEASE:
+    if (synq) {
+        pthread_mutex_lock(&lcb->mutex);
+        lcb->nsynq--;
+        pthread_mutex_unlock(&lcb->mutex);
+    }
+    return cb;
+}
+
 static void
 tcp_rx (uint8_t *segment, size_t len, ip_addr_t *src, ip_addr_t *dst, struct netif *iface) {
     struct tcp_hdr *hdr;
+    size_t hlen;
     uint32_t pseudo = 0;
-    struct tcp_cb *cb, *fcb = NULL, *lcb = NULL;
+    struct tcp_cb *cb, *lcb = NULL;
 
     if (*dst != ((struct netif_ip *)iface)->unicast) {
         return;
@@ -418,6 +3211,10 @@ tcp_rx (uint8_t *segment, size_t len, ip_addr_t *src, ip_addr_t *dst, struct net
         return;
     }
     hdr = (struct tcp_hdr *)segment;
+    hlen = (hdr->off >> 4) << 2;
+    if (hlen < sizeof(struct tcp_hdr) || hlen > len) {
+        return;
+    }
     pseudo += *src >> 16;
     pseudo += *src & 0xffff;
     pseudo += *dst >> 16;
@@ -428,181 +3225,206 @@ tcp_rx (uint8_t *segment, size_t len, ip_addr_t *src, ip_addr_t *dst, struct net
         fprintf(stderr, "tcp checksum error\n");
         return;
     }
-    pthread_mutex_lock(&mutex);
-    for (cb = cb_table; cb < array_tailof(cb_table); cb++) {
-        if (!cb->used) {
-            if (!fcb) {
-                fcb = cb;
-            }
-        }
-        else if ((!cb->iface || cb->iface == iface) && cb->port == hdr->dst) {
-            if (cb->peer.addr == *src && cb->peer.port == hdr->src) {
-                break;
-            }
-            if (cb->state == TCP_CB_STATE_LISTEN && !lcb) {
-                lcb = cb;
-            }
-        }
+    pthread_rwlock_rdlock(&table_lock);
+    cb = tcp_conn_lookup(iface, *src, hdr->src, hdr->dst);
+    if (cb) {
+        tcp_cb_get(cb);
+    } else if ((lcb = tcp_listener_lookup(iface, hdr->dst))) {
+        tcp_cb_get(lcb);
     }
-    if (cb == array_tailof(cb_table)) {
-        if (!lcb || !fcb || !TCP_FLG_IS(hdr->flg, TCP_FLG_SYN)) {
-            // send RST
-            pthread_mutex_unlock(&mutex);
+    pthread_rwlock_unlock(&table_lock);
+    if (!cb) {
+        cb = tcp_rx_passive(hdr, len, *src, iface, lcb);
+        if (lcb) {
+            tcp_cb_put(lcb);
+        }
+        if (!cb) {
             return;
         }
-        cb = fcb;
-        cb->used = 1;
-        cb->state = lcb->state;
-        cb->iface = iface;
-        cb->port = lcb->port;
-        cb->peer.addr = *src;
-        cb->peer.port = hdr->src;
-        cb->rcv.wnd = sizeof(cb->window);
-        cb->parent = lcb;
     }
+    pthread_mutex_lock(&cb->mutex);
     tcp_incoming_event(cb, hdr, len);
-    pthread_mutex_unlock(&mutex);
+    pthread_mutex_unlock(&cb->mutex);
+    tcp_cb_put(cb);
     return;
 }
 
 int
 tcp_api_open (void) {
     struct tcp_cb *cb;
+    int soc;
 
-    pthread_mutex_lock(&mutex);
-    for (cb = cb_table; cb < array_tailof(cb_table); cb++) {
-        if (!cb->used) {
-            cb->used = 1;
-            pthread_mutex_unlock(&mutex);
-            return array_offset(cb_table, cb);
-        }
+    pthread_rwlock_wrlock(&table_lock);
+    cb = tcp_cb_alloc();
+    if (!cb) {
+        pthread_rwlock_unlock(&table_lock);
+        return -1;
     }
-    pthread_mutex_unlock(&mutex);
-    return -1;
+    soc = tcp_socket_alloc(cb);
+    if (soc == -1) {
+        tcp_cb_unlink(cb);
+        tcp_cb_put(cb);
+    }
+    pthread_rwlock_unlock(&table_lock);
+    return soc;
 }
 
 int
 tcp_api_close (int soc) {
     struct tcp_cb *cb;
 
-    if (TCP_SOCKET_ISINVALID(soc)) {
-        return -1;
-    }
-    pthread_mutex_lock(&mutex);
-    cb = &cb_table[soc];
-    if (!cb->used) {
-        pthread_mutex_unlock(&mutex);
+    cb = tcp_socket_get(soc);
+    if (!cb) {
         return -1;
     }
     switch (cb->state) {
+        case TCP_CB_STATE_LISTEN:
+            tcp_listen_close(cb);
+            break;
         case TCP_CB_STATE_SYN_RCVD:
         case TCP_CB_STATE_ESTABLISHED:
-            tcp_tx(cb, cb->snd.nxt, cb->rcv.nxt, TCP_FLG_FIN | TCP_FLG_ACK, NULL, 0);
+            cb->flags |= TCP_CB_FLG_FIN_PENDING;
             cb->state = TCP_CB_STATE_FIN_WAIT1;
-            cb->snd.nxt++;
-            pthread_cond_wait(&cb->cond, &mutex);
+            tcp_output(cb);
+            while (cb->state == TCP_CB_STATE_FIN_WAIT1 || cb->state == TCP_CB_STATE_FIN_WAIT2 || cb->state == TCP_CB_STATE_CLOSING) {
+                pthread_cond_wait(&cb->cond, &cb->mutex);
+            }
             break;
         case TCP_CB_STATE_CLOSE_WAIT:
-            tcp_tx(cb, cb->snd.nxt, cb->rcv.nxt, TCP_FLG_FIN | TCP_FLG_ACK, NULL, 0);
+            cb->flags |= TCP_CB_FLG_FIN_PENDING;
             cb->state = TCP_CB_STATE_LAST_ACK;
-            cb->snd.nxt++;
-            pthread_cond_wait(&cb->cond, &mutex);
+            tcp_output(cb);
+            while (cb->state == TCP_CB_STATE_LAST_ACK) {
+                pthread_cond_wait(&cb->cond, &cb->mutex);
+            }
             break;
         default:
             break;
     }
-    cb->used = 0;
+    if (cb->state == TCP_CB_STATE_TIME_WAIT) {
+        /* kept for want of a tcp_tw entry, the descriptor is released now and the TCB when its timer expires */
+        pthread_rwlock_wrlock(&table_lock);
+        tcp_socket_free(cb->desc);
+        cb->desc = -1;
+        pthread_rwlock_unlock(&table_lock);
+        tcp_socket_put(cb);
+        return 0;
+    }
     cb->state = TCP_CB_STATE_CLOSED;
-    cb->port = 0;
-    pthread_mutex_unlock(&mutex);
+    pthread_mutex_unlock(&cb->mutex);
+    pthread_rwlock_wrlock(&table_lock);
+    tcp_cb_unlink(cb);
+    pthread_rwlock_unlock(&table_lock);
+    tcp_cb_put(cb);
+    tcp_cb_put(cb);
     return 0;
 }
 
 int
 tcp_api_connect (int soc, ip_addr_t *addr, uint16_t port) {
-    struct tcp_cb *cb, *tmp;
+    struct tcp_cb *cb;
     uint32_t p;
+    int ret;
 
-    if (TCP_SOCKET_ISINVALID(soc)) {
+    cb = tcp_socket_get(soc);
+    if (!cb) {
         return -1;
     }
-    pthread_mutex_lock(&mutex);
-    cb = &cb_table[soc];
-    if (!cb->used || cb->state != TCP_CB_STATE_CLOSED) {
-        pthread_mutex_unlock(&mutex);
+    if (cb->state != TCP_CB_STATE_CLOSED) {
+        tcp_socket_put(cb);
         return -1;
     }
+    if (!cb->iface) {
+        cb->iface = ip_netif_by_peer(addr);
+        if (!cb->iface) {
+            tcp_socket_put(cb);
+            return -1;
+        }
+    }
+    pthread_rwlock_wrlock(&table_lock);
     if (!cb->port) {
         int offset = time(NULL) % 1024;
         for (p = TCP_SOURCE_PORT_MIN + offset; p <= TCP_SOURCE_PORT_MAX; p++) {
-            for (tmp = cb_table; tmp < array_tailof(cb_table); tmp++) {
-                if (tmp->used && tmp->port == hton16((uint16_t)p)) {
-                    break;
-                }
-            }
-            if (tmp == array_tailof(cb_table)) {
+            if (!tcp_port_lookup(hton16((uint16_t)p)) && !tcp_tw_lookup(cb->iface, *addr, port, hton16((uint16_t)p))) {
                 cb->port = hton16((uint16_t)p);
+                tcp_port_hash_add(cb);
                 break;
             }
         }
         if (!cb->port) {
-            pthread_mutex_unlock(&mutex);
+            pthread_rwlock_unlock(&table_lock);
+            tcp_socket_put(cb);
             return -1;
         }
     }
     cb->peer.addr = *addr;
     cb->peer.port = port;
-    cb->rcv.wnd = sizeof(cb->window);
+    tcp_conn_hash_add(cb);
+    pthread_rwlock_unlock(&table_lock);
+    cb->rcv.wnd = cb->rcvbuf.size;
+    cb->rcv.wscale = tcp_wscale(cb->rcvbuf.size);
+    cb->ts.offset = (uint32_t)random();
     cb->iss = (uint32_t)random();
-    tcp_tx(cb, cb->iss, 0, TCP_FLG_SYN, NULL, 0);
+    cb->snd.una = cb->iss;
+    cb->snd.max = cb->iss;
+    cb->recover = cb->iss;
+    if (tcp_tx(cb, cb->iss, 0, TCP_FLG_SYN, NULL, 0) == -1) {
+        pthread_rwlock_wrlock(&table_lock);
+        tcp_conn_hash_del(cb);
+        pthread_rwlock_unlock(&table_lock);
+        tcp_socket_put(cb);
+        return -1;
+    }
     cb->snd.nxt = cb->iss + 1;
     cb->state = TCP_CB_STATE_SYN_SENT;
     while (cb->state == TCP_CB_STATE_SYN_SENT) {
-        pthread_cond_wait(&cb_table[soc].cond, &mutex);
+        pthread_cond_wait(&cb->cond, &cb->mutex);
     }
-    pthread_mutex_unlock(&mutex);
-    return 0;
+    ret = cb->state == TCP_CB_STATE_ESTABLISHED ? 0 : -1;
+    tcp_socket_put(cb);
+    return ret;
 }
 
 int
 tcp_api_bind (int soc, uint16_t port) {
     struct tcp_cb *cb;
 
-    if (TCP_SOCKET_ISINVALID(soc)) {
+    cb = tcp_socket_get(soc);
+    if (!cb) {
         return -1;
     }
-    pthread_mutex_lock(&mutex);
-    for (cb = cb_table; cb < array_tailof(cb_table); cb++) {
-        if (cb->port == port) {
-            pthread_mutex_unlock(&mutex);
-            return -1;
-        }
+    if (cb->state != TCP_CB_STATE_CLOSED || cb->port) {
+        tcp_socket_put(cb);
+        return -1;
     }
-    cb = &cb_table[soc];
-    if (!cb->used || cb->state != TCP_CB_STATE_CLOSED) {
-        pthread_mutex_unlock(&mutex);
+    pthread_rwlock_wrlock(&table_lock);
+    if (tcp_port_lookup(port)) {
+        pthread_rwlock_unlock(&table_lock);
+        tcp_socket_put(cb);
         return -1;
     }
     cb->port = port;
-    pthread_mutex_unlock(&mutex);
+    tcp_port_hash_add(cb);
+    pthread_rwlock_unlock(&table_lock);
+    tcp_socket_put(cb);
     return 0;
 }
 
 int
-tcp_api_listen (int soc) {
+tcp_api_listen (int soc, int backlog) {
     struct tcp_cb *cb;
 
-    if (TCP_SOCKET_ISINVALID(soc)) {
+    cb = tcp_socket_get(soc);
+    if (!cb) {
         return -1;
     }
-    pthread_mutex_lock(&mutex);
-    cb = &cb_table[soc];
-    if (!cb->used || cb->state != TCP_CB_STATE_CLOSED || !cb->port) {
-        pthread_mutex_unlock(&mutex);
+    if (cb->state != TCP_CB_STATE_CLOSED || !cb->port) {
+        tcp_socket_put(cb);
         return -1;
     }
+    cb->backlog_max = backlog > 0 ? backlog : TCP_BACKLOG_DEFAULT;
     cb->state = TCP_CB_STATE_LISTEN;
-    pthread_mutex_unlock(&mutex);
+    tcp_socket_put(cb);
     return 0;
 }
 
@@ -610,89 +3432,226 @@ int
 tcp_api_accept (int soc) {
     struct tcp_cb *cb, *backlog;
     struct queue_entry *entry;
+    int acc;
 
-    if (TCP_SOCKET_ISINVALID(soc)) {
+    cb = tcp_socket_get(soc);
+    if (!cb) {
         return -1;
     }
-    pthread_mutex_lock(&mutex);
-    cb = &cb_table[soc];
-    if (!cb->used) {
-        pthread_mutex_unlock(&mutex);
+    if (cb->state != TCP_CB_STATE_LISTEN) {
+        tcp_socket_put(cb);
         return -1;
     }
+    while (cb->state == TCP_CB_STATE_LISTEN && (entry = queue_pop(&cb->backlog)) == NULL) {
+        pthread_cond_wait(&cb->cond, &cb->mutex);
+    }
     if (cb->state != TCP_CB_STATE_LISTEN) {
-        pthread_mutex_unlock(&mutex);
+        /* closed while waiting, tcp_api_close() takes care of the queue */
+        tcp_socket_put(cb);
         return -1;
     }
-    while ((entry = queue_pop(&cb->backlog)) == NULL) {
-        pthread_cond_wait(&cb->cond, &mutex);
-    }
     backlog = entry->data;
     free(entry);
-    pthread_mutex_unlock(&mutex);
-    return array_offset(cb_table, backlog);
+    /* a child waiting for room takes the slot */
+    if (cb->overflow.next && queue_push(&cb->backlog, cb->overflow.next->data, sizeof(struct tcp_cb))) {
+        free(queue_pop(&cb->overflow));
+    }
+    pthread_rwlock_wrlock(&table_lock);
+    acc = tcp_socket_alloc(backlog);
+    pthread_rwlock_unlock(&table_lock);
+    tcp_socket_put(cb);
+    return acc;
 }
 
 ssize_t
 tcp_api_recv (int soc, uint8_t *buf, size_t size) {
     struct tcp_cb *cb;
     size_t total, len;
+    uint32_t adv;
 
-    if (TCP_SOCKET_ISINVALID(soc)) {
-        return -1;
-    }
-    pthread_mutex_lock(&mutex);
-    cb = &cb_table[soc];
-    if (!cb->used) {
-        pthread_mutex_unlock(&mutex);
+    cb = tcp_socket_get(soc);
+    if (!cb) {
         return -1;
     }
-    while (!(total = sizeof(cb->window) - cb->rcv.wnd)) {
+    while (!(total = cb->rcvbuf.len)) {
         if (!TCP_CB_STATE_RX_ISREADY(cb)) {
-            pthread_mutex_unlock(&mutex);
+            tcp_socket_put(cb);
             return 0;
         }
-        pthread_cond_wait(&cb->cond, &mutex);
+        pthread_cond_wait(&cb->cond, &cb->mutex);
     }
     len = size < total ? size : total;
-    memcpy(buf, cb->window, len);
-    memmove(cb->window, cb->window + len, total - len);
+    tcp_ring_read(&cb->rcvbuf, 0, buf, len);
+    tcp_ring_consume(&cb->rcvbuf, len);
     cb->rcv.wnd += len;
-    pthread_mutex_unlock(&mutex);
+    if (TCP_CB_STATE_RX_ISREADY(cb)) {
+        /*
+         * Announce the window when what the peer may still send is down to
+         * half the buffer and reading has at least doubled it, by no less
+         * than a segment (RFC 1122 4.2.3.3). Otherwise ACKs for new data
+         * carry it.
+         */
+        adv = TCP_SEQ_GT(cb->rcv.adv, cb->rcv.nxt) ? cb->rcv.adv - cb->rcv.nxt : 0;
+        if (2 * (size_t)adv <= cb->rcvbuf.size && cb->rcv.wnd >= 2 * adv && cb->rcv.wnd - adv >= MIN(cb->rcvbuf.size / 2, (size_t)cb->mss)) {
+            tcp_tx(cb, cb->snd.nxt, cb->rcv.nxt, TCP_FLG_ACK, NULL, 0);
+        }
+    }
+    tcp_socket_put(cb);
     return len;
 }
 
+/*
+ * Queue data into the send buffer, blocking while it is full. Returns
+ * the number of bytes queued, which is less than len only if the
+ * connection can no longer send.
+ */
 ssize_t
 tcp_api_send (int soc, uint8_t *buf, size_t len) {
     struct tcp_cb *cb;
+    size_t sent = 0, n;
 
-    if (TCP_SOCKET_ISINVALID(soc)) {
+    cb = tcp_socket_get(soc);
+    if (!cb) {
         return -1;
     }
-    pthread_mutex_lock(&mutex);
-    cb = &cb_table[soc];
-    if (!cb->used) {
-        pthread_mutex_unlock(&mutex);
-        return -1;
+    while (sent < len) {
+        if (!TCP_CB_STATE_TX_ISREADY(cb)) {
+            break;
+        }
+        if (cb->sndbuf.len == cb->sndbuf.size) {
+            pthread_cond_wait(&cb->cond, &cb->mutex);
+            continue;
+        }
+        n = tcp_ring_write(&cb->sndbuf, buf + sent, len - sent);
+        if (!n) {
+            break;
+        }
+        sent += n;
+        tcp_output(cb);
     }
-    if (!TCP_CB_STATE_TX_ISREADY(cb)) {
-        pthread_mutex_unlock(&mutex);
+    tcp_socket_put(cb);
+    return sent ? (ssize_t)sent : -1;
+}
+
+int
+tcp_api_setopt (int soc, int opt, const void *val, size_t len) {
+    struct tcp_cb *cb;
+    struct tcp_cc_ops *ops;
+    uint16_t flg;
+    int n;
+
+    cb = tcp_socket_get(soc);
+    if (!cb) {
         return -1;
     }
-    tcp_tx(cb, cb->snd.nxt, cb->rcv.nxt, TCP_FLG_ACK | TCP_FLG_PSH, buf, len);
-    cb->snd.nxt += len;
-    pthread_mutex_unlock(&mutex);
+    switch (opt) {
+        case TCP_OPT_RCVBUF:
+            if (len != sizeof(int) || (cb->state != TCP_CB_STATE_CLOSED && cb->state != TCP_CB_STATE_LISTEN)) {
+                tcp_socket_put(cb);
+                return -1;
+            }
+            n = *(const int *)val;
+            cb->rcvbuf.size = n < TCP_RCVBUF_MIN ? TCP_RCVBUF_MIN : (n > TCP_RCVBUF_MAX ? TCP_RCVBUF_MAX : n);
+            break;
+        case TCP_OPT_SNDBUF:
+            if (len != sizeof(int) || cb->sndbuf.len) {
+                tcp_socket_put(cb);
+                return -1;
+            }
+            n = *(const int *)val;
+            cb->sndbuf.size = n < TCP_SNDBUF_MIN ? TCP_SNDBUF_MIN : (n > TCP_SNDBUF_MAX ? TCP_SNDBUF_MAX : n);
+            break;
+        case TCP_OPT_CONGESTION:
+            if (len != sizeof(int) || !(ops = tcp_cc_ops_lookup(*(const int *)val))) {
+                tcp_socket_put(cb);
+                return -1;
+            }
+            if (cb->cc.ops != ops) {
+                cb->cc.ops = ops;
+                if (cb->mss) {
+                    /* take over the current window */
+                    cb->cc.pacing_rate = 0;
+                    ops->init(&cb->cc);
+                }
+            }
+            break;
+        case TCP_OPT_NODELAY:
+        case TCP_OPT_CORK:
+            if (len != sizeof(int)) {
+                tcp_socket_put(cb);
+                return -1;
+            }
+            flg = opt == TCP_OPT_NODELAY ? TCP_CB_FLG_NODELAY : TCP_CB_FLG_CORK;
+            if (*(const int *)val) {
+                cb->flags |= flg;
+            } else {
+                cb->flags &= ~flg;
+            }
+            /* what was held back may go now */
+            tcp_output(cb);
+            break;
+        case TCP_OPT_SYNCOOKIES:
+            if (len != sizeof(int)) {
+                tcp_socket_put(cb);
+                return -1;
+            }
+            if (*(const int *)val) {
+                cb->flags |= TCP_CB_FLG_SYNCOOKIES;
+            } else {
+                cb->flags &= ~TCP_CB_FLG_SYNCOOKIES;
+            }
+            break;
+        case TCP_OPT_SYNQ:
+            if (len != sizeof(int) || *(const int *)val <= 0) {
+                tcp_socket_put(cb);
+                return -1;
+            }
+            cb->synq_max = *(const int *)val;
+            break;
+        case TCP_OPT_RACK:
+            if (len != sizeof(int)) {
+                tcp_socket_put(cb);
+                return -1;
+            }
+            if (*(const int *)val) {
+                cb->flags |= TCP_CB_FLG_RACK;
+            } else {
+                cb->flags &= ~TCP_CB_FLG_RACK;
+                cb->rack.expire = 0;
+                cb->tlp.expire = 0;
+            }
+            break;
+        default:
+            tcp_socket_put(cb);
+            return -1;
+    }
+    tcp_socket_put(cb);
     return 0;
 }
 
 int
 tcp_init (void) {
-    struct tcp_cb *cb;
+    pthread_condattr_t attr;
 
-    for (cb = cb_table; cb < array_tailof(cb_table); cb++) {
-        pthread_cond_init(&cb->cond, NULL);
+    /* a seed that cannot be guessed keeps peers from choosing 4-tuples that collide */
+    if (random_bytes(&hash_seed, sizeof(hash_seed)) == -1) {
+        return -1;
+    }
+    conn_hash = calloc(TCP_CONN_HASH_SIZE_MIN, sizeof(*conn_hash));
+    tw_hash = calloc(TCP_CONN_HASH_SIZE_MIN, sizeof(*tw_hash));
+    if (!conn_hash || !tw_hash) {
+        return -1;
+    }
+    conn_hash_size = TCP_CONN_HASH_SIZE_MIN;
+    tw_hash_size = TCP_CONN_HASH_SIZE_MIN;
+    if (random_bytes(syncookie_key, sizeof(syncookie_key)) == -1 || random_bytes(&syncookie_tsoff, sizeof(syncookie_tsoff)) == -1) {
+        return -1;
     }
-    pthread_mutex_init(&mutex, NULL);
+    /* deadlines are on the tcp_clock() timeline */
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&timer_cond, &attr);
+    pthread_condattr_destroy(&attr);
     if (ip_add_protocol(IP_PROTOCOL_TCP, tcp_rx) == -1) {
         return -1;
     }
@@ -3,6 +3,19 @@
 #include <stdint.h>
 #include "ip.h"
 
+#define TCP_OPT_RCVBUF 1 /* int: receive buffer size (set before connect/listen) */
+#define TCP_OPT_SNDBUF 2 /* int: send buffer size (set while nothing is queued) */
+#define TCP_OPT_CONGESTION 3 /* int: congestion control algorithm (TCP_CC_*) */
+#define TCP_OPT_RACK 4 /* int: RACK-TLP loss detection instead of duplicate ACK counting (default on, needs SACK) */
+#define TCP_OPT_NODELAY 5 /* int: send small segments at once instead of waiting for outstanding data to be acknowledged */
+#define TCP_OPT_CORK 6 /* int: hold partial segments until cleared */
+#define TCP_OPT_SYNCOOKIES 7 /* int: answer SYNs with SYN cookies once a listener's half-open queue is full (default on) */
+#define TCP_OPT_SYNQ 8 /* int: bound on a listener's half-open connections, apart from the accept backlog (default 256) */
+
+#define TCP_CC_NEWRENO 0 /* default */
+#define TCP_CC_CUBIC 1
+#define TCP_CC_BBR 2
+
 extern int
 tcp_init (void);
 extern int
@@ -14,10 +27,12 @@ tcp_api_connect (int soc, ip_addr_t *addr, uint16_t port);
 extern int
 tcp_api_bind (int soc, uint16_t port);
 extern int
-tcp_api_listen (int soc);
+tcp_api_listen (int soc, int backlog);
 extern int
 tcp_api_accept (int soc);
 extern ssize_t
 tcp_api_recv (int soc, uint8_t *buf, size_t size);
 extern ssize_t
 tcp_api_send (int soc, uint8_t *buf, size_t len);
+extern int
+tcp_api_setopt (int soc, int opt, const void *val, size_t len);
@@ -0,0 +1,51 @@
+#ifndef TCP_CC_H
+#define TCP_CC_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define TCP_CC_CWND_MAX (1U << 30)
+#define TCP_CC_PRIV_SIZE 128
+
+struct tcp_cc;
+
+/* what an ACK that advanced snd.una tells the algorithm */
+struct tcp_cc_ack {
+    uint32_t acked;    /* bytes newly acknowledged */
+    uint32_t inflight; /* bytes still outstanding */
+    uint32_t rtt;      /* usec, 0 if the ACK gave no sample */
+    uint32_t srtt;     /* usec, 0 until the first sample */
+    uint64_t now;      /* usec */
+    uint64_t delivered;       /* bytes acknowledged over the connection so far */
+    uint64_t prior_delivered; /* delivered when the newest acked segment was sent */
+    uint64_t rate;            /* bytes/sec delivered while that segment was out, 0 if unknown */
+    int recovery;             /* fast recovery is under way */
+};
+
+struct tcp_cc_ops {
+    const char *name;
+    void (*init)(struct tcp_cc *cc);
+    void (*on_ack)(struct tcp_cc *cc, const struct tcp_cc_ack *ack);
+    /* loss detected while the ACK clock is running (fast retransmit) */
+    void (*on_loss)(struct tcp_cc *cc, uint32_t inflight);
+    /* the retransmission timer expired */
+    void (*on_rto)(struct tcp_cc *cc, uint32_t inflight);
+};
+
+/*
+ * Congestion state of a connection. cwnd and ssthresh are in bytes and
+ * start out as RFC 5681 and RFC 6928 describe before init is called;
+ * the algorithm keeps its own state in priv.
+ */
+struct tcp_cc {
+    struct tcp_cc_ops *ops;
+    uint32_t mss;
+    uint32_t cwnd;
+    uint32_t ssthresh;
+    uint64_t pacing_rate; /* bytes/sec, 0 for no pacing */
+    uint64_t priv[TCP_CC_PRIV_SIZE / sizeof(uint64_t)];
+};
+
+#define TCP_CC_PRIV(x) ((void *)(x)->priv)
+
+#endif
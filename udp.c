@@ -57,17 +57,25 @@ udp_dump (struct netif *netif, uint8_t *packet, size_t plen) {
 
 static ssize_t
 udp_tx (struct netif *iface, uint16_t sport, uint8_t *buf, size_t len, ip_addr_t *peer, uint16_t port) {
-    char packet[65536];
+    struct pkbuf *pkb;
     struct udp_hdr *hdr;
     ip_addr_t self;
     uint32_t pseudo = 0;
+    ssize_t ret;
 
-    hdr = (struct udp_hdr *)packet;
+    if (len > IP_PAYLOAD_SIZE_MAX - sizeof(struct udp_hdr)) {
+        return -1;
+    }
+    pkb = pkbuf_alloc(sizeof(struct udp_hdr) + len);
+    if (!pkb) {
+        return -1;
+    }
+    memcpy(pkbuf_put(pkb, len), buf, len);
+    hdr = (struct udp_hdr *)pkbuf_push(pkb, sizeof(struct udp_hdr));
     hdr->sport = sport;
     hdr->dport = port;
     hdr->len = hton16(sizeof(struct udp_hdr) + len);
     hdr->sum = 0;
-    memcpy(hdr + 1, buf, len);
     self = ((struct netif_ip *)iface)->unicast;
     pseudo += (self >> 16) & 0xffff;
     pseudo += self & 0xffff;
@@ -78,9 +86,11 @@ udp_tx (struct netif *iface, uint16_t sport, uint8_t *buf, size_t len, ip_addr_t
     hdr->sum = cksum16((uint16_t *)hdr, sizeof(struct udp_hdr) + len, pseudo);
 #ifdef DEBUG
     fprintf(stderr, ">>> udp_tx <<<\n");
-    udp_dump((struct netif *)iface, (uint8_t *)packet, sizeof(struct udp_hdr) + len);
+    udp_dump((struct netif *)iface, (uint8_t *)hdr, sizeof(struct udp_hdr) + len);
 #endif
-    return ip_tx(iface, IP_PROTOCOL_UDP, (uint8_t *)packet, sizeof(struct udp_hdr) + len, peer);
+    ret = ip_tx(iface, IP_PROTOCOL_UDP, pkb, peer);
+    pkbuf_free(pkb);
+    return ret;
 }
 
 static void
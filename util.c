@@ -4,6 +4,11 @@
 #include <errno.h>
 #include <limits.h>
 #include <ctype.h>
+#include <fcntl.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/random.h>
+#endif
 #include "util.h"
 
 void
@@ -263,3 +268,54 @@ bitmap_set_bit (uint32_t *bitmap, size_t size, size_t offset, size_t len) {
     }
 }
 */
+
+/* fill buf from the system's CSPRNG, for secrets chosen at startup */
+#ifdef __linux__
+int
+random_bytes (void *buf, size_t len) {
+    uint8_t *p = buf;
+    ssize_t ret;
+
+    while (len) {
+        ret = getrandom(p, len, 0);
+        if (ret == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("getrandom");
+            return -1;
+        }
+        p += ret;
+        len -= ret;
+    }
+    return 0;
+}
+#else
+int
+random_bytes (void *buf, size_t len) {
+    uint8_t *p = buf;
+    ssize_t ret;
+    int fd;
+
+    fd = open("/dev/urandom", O_RDONLY);
+    if (fd == -1) {
+        perror("open [/dev/urandom]");
+        return -1;
+    }
+    while (len) {
+        ret = read(fd, p, len);
+        if (ret <= 0) {
+            if (ret == -1 && errno == EINTR) {
+                continue;
+            }
+            perror("read [/dev/urandom]");
+            close(fd);
+            return -1;
+        }
+        p += ret;
+        len -= ret;
+    }
+    close(fd);
+    return 0;
+}
+#endif
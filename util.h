@@ -56,5 +56,7 @@ extern void
 maskclr (uint32_t *mask, size_t size);
 extern void
 maskdbg (void *mask, size_t size);
+extern int
+random_bytes (void *buf, size_t len);
 
 #endif